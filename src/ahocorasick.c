@@ -0,0 +1,215 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * The automaton is built as a complete DFA, with failure links folded into the
+ * transition table, so searching takes a single table lookup per character.
+ * To keep the table small, characters are first mapped to a compact alphabet
+ * consisting of only those characters that appear in some pattern, plus one
+ * symbol for everything else, which always leads back to the root.
+ *
+ */
+
+#include "ahocorasick.h"
+#include "common.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+
+struct ac_t_
+{
+    /* patterns, null-terminated and folded to upper case */
+    char** patterns;
+    size_t num_patterns;
+    size_t patterns_size;
+
+    /* character to alphabet symbol, 0 being everything else */
+    uint8_t sym[256];
+    size_t sigma;
+
+    /* transitions, sigma per state, with state 0 being the root */
+    int32_t* next;
+    size_t num_states;
+    size_t states_size;
+
+    /* longest pattern ending at each state, or -1 */
+    int32_t* out;
+
+    /* depth of each state, i.e., the length of the string it spells */
+    int32_t* depth;
+};
+
+
+ac_t* fastq_alloc_ac()
+{
+    ac_t* ac = malloc_or_die(sizeof(ac_t));
+    ac->num_patterns = 0;
+    ac->patterns_size = 64;
+    ac->patterns = malloc_or_die(ac->patterns_size * sizeof(char*));
+    memset(ac->sym, 0, sizeof(ac->sym));
+    ac->sigma = 1;
+    ac->next = NULL;
+    ac->out = NULL;
+    ac->depth = NULL;
+    ac->num_states = 0;
+    ac->states_size = 0;
+    return ac;
+}
+
+
+void fastq_free_ac(ac_t* ac)
+{
+    size_t i;
+    for (i = 0; i < ac->num_patterns; ++i) free(ac->patterns[i]);
+    free(ac->patterns);
+    free(ac->next);
+    free(ac->out);
+    free(ac->depth);
+    free(ac);
+}
+
+
+void fastq_ac_add(ac_t* ac, const char* pattern, size_t n)
+{
+    if (ac->num_patterns == ac->patterns_size) {
+        ac->patterns_size *= 2;
+        ac->patterns = realloc_or_die(ac->patterns,
+                                      ac->patterns_size * sizeof(char*));
+    }
+
+    char* p = malloc_or_die(n + 1);
+    size_t i;
+    for (i = 0; i < n; ++i) p[i] = toupper((unsigned char) pattern[i]);
+    p[n] = '\0';
+
+    ac->patterns[ac->num_patterns++] = p;
+}
+
+
+size_t fastq_ac_size(const ac_t* ac)
+{
+    return ac->num_patterns;
+}
+
+
+const char* fastq_ac_pattern(const ac_t* ac, size_t i)
+{
+    return ac->patterns[i];
+}
+
+
+static int32_t ac_new_state(ac_t* ac, int32_t depth)
+{
+    if (ac->num_states == ac->states_size) {
+        ac->states_size = ac->states_size ? 2 * ac->states_size : 1024;
+        ac->next  = realloc_or_die(ac->next,
+                                   ac->states_size * ac->sigma * sizeof(int32_t));
+        ac->out   = realloc_or_die(ac->out, ac->states_size * sizeof(int32_t));
+        ac->depth = realloc_or_die(ac->depth, ac->states_size * sizeof(int32_t));
+    }
+
+    int32_t s = ac->num_states++;
+    memset(&ac->next[s * ac->sigma], 0, ac->sigma * sizeof(int32_t));
+    ac->out[s] = -1;
+    ac->depth[s] = depth;
+    return s;
+}
+
+
+void fastq_ac_build(ac_t* ac)
+{
+    size_t i, j;
+    const unsigned char* p;
+
+    /* alphabet, with upper and lower case sharing a symbol */
+    for (i = 0; i < ac->num_patterns; ++i) {
+        for (p = (const unsigned char*) ac->patterns[i]; *p; ++p) {
+            if (ac->sym[*p] == 0) {
+                ac->sym[*p] = ac->sym[tolower(*p)] = ac->sigma++;
+            }
+        }
+    }
+
+    /* trie, where 0 doubles as "no child" since the root is never a child */
+    ac_new_state(ac, 0);
+    int32_t s, t;
+    for (i = 0; i < ac->num_patterns; ++i) {
+        s = 0;
+        for (p = (const unsigned char*) ac->patterns[i]; *p; ++p) {
+            t = ac->next[s * ac->sigma + ac->sym[*p]];
+            if (t == 0) {
+                t = ac_new_state(ac, ac->depth[s] + 1);
+                ac->next[s * ac->sigma + ac->sym[*p]] = t;
+            }
+            s = t;
+        }
+
+        /* the first of any duplicate patterns is reported */
+        if (ac->out[s] < 0) ac->out[s] = i;
+    }
+
+    /* Breadth-first, fill in missing transitions from each state's failure
+     * state, which is always shallower and so already complete. */
+    int32_t* fail  = malloc_or_die(ac->num_states * sizeof(int32_t));
+    int32_t* queue = malloc_or_die(ac->num_states * sizeof(int32_t));
+    size_t qhead = 0, qtail = 0;
+
+    fail[0] = 0;
+    for (j = 1; j < ac->sigma; ++j) {
+        t = ac->next[j];
+        if (t != 0) {
+            fail[t] = 0;
+            queue[qtail++] = t;
+        }
+    }
+
+    while (qhead < qtail) {
+        s = queue[qhead++];
+
+        /* a state with no pattern of its own reports the longest proper
+         * suffix that is one */
+        if (ac->out[s] < 0) ac->out[s] = ac->out[fail[s]];
+
+        for (j = 1; j < ac->sigma; ++j) {
+            t = ac->next[s * ac->sigma + j];
+            if (t != 0) {
+                fail[t] = ac->next[fail[s] * ac->sigma + j];
+                queue[qtail++] = t;
+            }
+            else {
+                ac->next[s * ac->sigma + j] = ac->next[fail[s] * ac->sigma + j];
+            }
+        }
+    }
+
+    free(queue);
+    free(fail);
+}
+
+
+int fastq_ac_search(const ac_t* ac, const char* s, size_t n, int* start, int* end)
+{
+    const int32_t* next = ac->next;
+    const uint8_t* sym  = ac->sym;
+    size_t sigma = ac->sigma;
+    int32_t q = 0;
+    int32_t k;
+    size_t i;
+
+    if (ac->num_states == 0) return -1;
+
+    for (i = 0; i < n; ++i) {
+        q = next[q * sigma + sym[(unsigned char) s[i]]];
+        k = ac->out[q];
+        if (k >= 0) {
+            *end   = (int) i + 1;
+            *start = *end - (int) strlen(ac->patterns[k]);
+            return k;
+        }
+    }
+
+    return -1;
+}
+
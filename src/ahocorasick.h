@@ -0,0 +1,40 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * ahocorasick :
+ * Simultaneous search for many literal patterns via the Aho-Corasick algorithm.
+ *
+ */
+
+#ifndef FASTQ_TOOLS_AHOCORASICK_H
+#define FASTQ_TOOLS_AHOCORASICK_H
+
+#include <stdlib.h>
+
+typedef struct ac_t_ ac_t;
+
+ac_t* fastq_alloc_ac();
+void  fastq_free_ac(ac_t*);
+
+/* Add a pattern, which is numbered in the order added. Matching is case
+ * insensitive. All patterns must be added before fastq_ac_build is called. */
+void fastq_ac_add(ac_t*, const char* pattern, size_t n);
+
+/* Number of patterns added. */
+size_t fastq_ac_size(const ac_t*);
+
+/* The i-th pattern added, null-terminated. */
+const char* fastq_ac_pattern(const ac_t*, size_t i);
+
+/* Construct the automaton, after which the patterns may be searched for. */
+void fastq_ac_build(ac_t*);
+
+/* Search for the match ending earliest in s, choosing the longest pattern
+ * should several end at the same position. Returns the pattern's number, or -1
+ * if nothing matches, and sets *start and *end to the match's offsets. */
+int fastq_ac_search(const ac_t*, const char* s, size_t n, int* start, int* end);
+
+#endif
+
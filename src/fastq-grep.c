@@ -10,8 +10,12 @@
  */
 
 
+#include "ahocorasick.h"
 #include "common.h"
 #include "parse.h"
+#include "pipeline.h"
+#include "strsearch.h"
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
@@ -35,9 +39,12 @@ void print_help()
 {
     fprintf(stdout,
 "fastq-grep [OPTION]... PATTERN [FILE]...\n"
+"fastq-grep [OPTION]... -f PATTERNS_FILE [FILE]...\n"
 "Search for PATTERN in the read sequences in each FILE or standard input.\n"
 "PATTERN, by default, is a perl compatible regular expression.\n\n"
 "Options:\n"
+"  -f, --file=FILE         search for every literal sequence in FILE, one per\n"
+"                          line, appending the one matched to the read id\n"
 "  -i, --id                match the read id (by default, sequence is matched)\n"
 "  -v, --invert-match      select nonmatching entries\n"
 "  -m, --mismatches=FILE   output mismatching entries to the given file\n"
@@ -45,6 +52,7 @@ void print_help()
 "  -a, --trim_after        trim output after the match end\n"
 "  -b, --trim_before       trim output before the match start\n"
 "  -t, --trim_match        trim the match itself, regardless of trimming mode\n"
+"  -p, --threads=NUM       number of threads to match with (default: 1)\n"
 "  -h, --help              print this message\n"
 "  -V, --version           output version information and exit\n"
     );
@@ -58,17 +66,193 @@ static int trim_after_flag;
 static int trim_match_flag;
 
 
-void fastq_print_maybe_trim(FILE* fout, seq_t* seq, int* ovector) 
+/* A compiled pattern, along with anything learned by studying it, or a set of
+ * literal patterns, if ac is not NULL. */
+typedef struct
 {
-    if (!trim_before_flag && !trim_after_flag) {
+    pcre* re;
+    pcre_extra* extra;
+    ac_t* ac;
+
+    /* A literal string that every match of re contains, or NULL. */
+    strsearch_t* literal;
+} pattern_t;
+
+
+/* Shortest literal worth searching for before running the pattern. */
+static const size_t min_literal_len = 3;
+
+
+/* End the run of literal characters in buf, keeping it in lit if it is the
+ * longest so far. */
+static void end_run(char* lit, size_t* best, const char* buf, size_t* cur)
+{
+    if (*cur > *best) {
+        *best = *cur;
+        memcpy(lit, buf, *cur);
+    }
+    *cur = 0;
+}
+
+
+/* Find the longest string of literal characters that any match of the pattern
+ * must contain, writing it to lit, which must be as long as the pattern, and
+ * returning its length.
+ *
+ * This is done without really parsing the pattern, so anything not understood
+ * is given up on, returning 0.
+ */
+size_t required_literal(const char* pat, char* lit)
+{
+    size_t best = 0, cur = 0;
+    char* buf = malloc_or_die(strlen(pat) + 1);
+    const char* p = pat;
+    int depth;
+
+    /* options and quoting may change what is literal */
+    if (strstr(pat, "(?") || strstr(pat, "\\Q")) {
+        free(buf);
+        return 0;
+    }
+
+    while (*p) {
+        switch (*p) {
+            case '|':
+                /* an alternative at the top level, since groups are skipped */
+                free(buf);
+                return 0;
+
+            case '(':
+                end_run(lit, &best, buf, &cur);
+                for (depth = 0; *p; ++p) {
+                    if (*p == '\\' && p[1]) ++p;
+                    else if (*p == '(') ++depth;
+                    else if (*p == ')' && --depth == 0) break;
+                }
+                if (*p) ++p;
+                break;
+
+            case '[':
+                end_run(lit, &best, buf, &cur);
+                ++p;
+                if (*p == '^') ++p;
+                if (*p == ']') ++p;
+                while (*p && *p != ']') {
+                    if (*p == '[' && p[1] && strchr(":.=", p[1])) {
+                        /* a class such as [:upper:], which ends at ":]" */
+                        const char* end = p + 2;
+                        while (*end && !(end[0] == p[1] && end[1] == ']')) ++end;
+                        if (*end == '\0') {
+                            free(buf);
+                            return 0;
+                        }
+                        p = end + 2;
+                        continue;
+                    }
+                    if (*p == '\\' && p[1]) ++p;
+                    ++p;
+                }
+                if (*p) ++p;
+                break;
+
+            case '.':
+            case '^':
+            case '$':
+            case '+':
+                end_run(lit, &best, buf, &cur);
+                ++p;
+                break;
+
+            case '?':
+            case '*':
+            case '{':
+                /* the preceding character is optional */
+                if (cur > 0) --cur;
+                end_run(lit, &best, buf, &cur);
+                if (*p == '{') {
+                    while (*p && *p != '}') ++p;
+                }
+                if (*p) ++p;
+                break;
+
+            case '\\':
+                if (p[1] == '\0') {
+                    free(buf);
+                    return 0;
+                }
+                else if (strchr("dDwWsSbB", p[1])) {
+                    end_run(lit, &best, buf, &cur);
+                    p += 2;
+                }
+                else if (isalnum((unsigned char) p[1])) {
+                    free(buf);
+                    return 0;
+                }
+                else {
+                    buf[cur++] = p[1];
+                    p += 2;
+                }
+                break;
+
+            default:
+                buf[cur++] = *p++;
+        }
+    }
+    end_run(lit, &best, buf, &cur);
+
+    free(buf);
+    return best;
+}
+
+
+/* Study a pattern, compiling it to machine code when PCRE was built with JIT
+ * support, and otherwise falling back to the interpreter. */
+pcre_extra* study_pattern(pcre* re)
+{
+    const char* err = NULL;
+    int options = 0;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+    int jit = 0;
+    if (pcre_config(PCRE_CONFIG_JIT, &jit) == 0 && jit) {
+        options |= PCRE_STUDY_JIT_COMPILE;
+    }
+#endif
+
+    pcre_extra* extra = pcre_study(re, options, &err);
+    if (err != NULL) {
+        fprintf(stderr, "Warning: unable to study pattern: %s\n", err);
+        return NULL;
+    }
+
+    /* NULL is returned if studying did not turn up anything useful. */
+    return extra;
+}
+
+
+void free_pattern_extra(pcre_extra* extra)
+{
+    if (extra == NULL) return;
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_free_study(extra);
+#else
+    pcre_free(extra);
+#endif
+}
+
+
+/* Print an entry, trimmed according to the match in ovector if trimming was
+ * requested, and with label, if not NULL, appended to its ID. */
+void fastq_print_maybe_trim(FILE* fout, seq_t* seq, int* ovector,
+                            const char* label)
+{
+    if (!label && !trim_before_flag && !trim_after_flag) {
         fastq_print(fout, seq);
         return;
     }
 
-    // trimming
-    seq_t* trimmed = seq_create();
     int trimmed_start = 0;
-    int trimmed_end   = 0;
+    int trimmed_end   = seq->seq.n;
     int match_start   = ovector[0];
     int match_end     = ovector[1];
     if (trim_before_flag) {
@@ -78,43 +262,192 @@ void fastq_print_maybe_trim(FILE* fout, seq_t* seq, int* ovector)
         trimmed_start = 0;
         trimmed_end = trim_match_flag ? match_start : match_end;
     }
-    seq_trim(seq, trimmed, trimmed_start, trimmed_end);
-    fastq_print(fout, trimmed);
-    seq_free(trimmed);
+
+    fprintf(fout, "@%s%s%s\n%.*s\n+%s\n%.*s\n",
+            seq->id1.s, label ? " " : "", label ? label : "",
+            trimmed_end - trimmed_start, seq->seq.s + trimmed_start,
+            seq->id2.s,
+            trimmed_end - trimmed_start, seq->qual.s + trimmed_start);
 }
 
-void fastq_grep(FILE* fin, FILE* fout, FILE* mismatch_file, pcre* re)
+
+/* Read literal patterns, one per line, ignoring blank lines and FASTA-style
+ * headers, into an automaton. */
+ac_t* read_patterns(const char* fn)
 {
-    int rc;
+    FILE* f = fopen(fn, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "No such file '%s'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+
+    ac_t* ac = fastq_alloc_ac();
+    size_t size = 4096;
+    char* line = malloc_or_die(size);
+    size_t n;
+
+    while (fgets(line, size, f)) {
+        n = strlen(line);
+
+        /* read the rest of a line too long for the buffer */
+        while (n > 0 && line[n - 1] != '\n' && !feof(f)) {
+            size *= 2;
+            line = realloc_or_die(line, size);
+            if (fgets(line + n, size - n, f) == NULL) break;
+            n += strlen(line + n);
+        }
+
+        while (n > 0 && isspace((unsigned char) line[n - 1])) --n;
+        if (n == 0 || line[0] == '>') continue;
+        fastq_ac_add(ac, line, n);
+    }
+    free(line);
+    fclose(f);
+
+    if (fastq_ac_size(ac) == 0) {
+        fprintf(stderr, "No patterns found in '%s'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+
+    fastq_ac_build(ac);
+    return ac;
+}
+
+
+/* Match results for a batch. */
+typedef struct
+{
+    int* rcs;      /* return code of pcre_exec, or the number of the
+                      literal pattern matched, for each entry */
+    int* ovectors; /* match start and end for each entry */
+    size_t size;   /* entries allocated */
+} grep_result_t;
+
+
+void* grep_result_create(void* ctx)
+{
+    (void) ctx;
+    grep_result_t* r = malloc_or_die(sizeof(grep_result_t));
+    r->size = 1024;
+    r->rcs = malloc_or_die(r->size * sizeof(int));
+    r->ovectors = malloc_or_die(2 * r->size * sizeof(int));
+    return r;
+}
+
+
+void grep_result_free(void* result, void* ctx)
+{
+    (void) ctx;
+    grep_result_t* r = result;
+    free(r->rcs);
+    free(r->ovectors);
+    free(r);
+}
+
+
+/* Match every entry in a batch. */
+void grep_batch(fastq_batch_t* batch, void* result, void* workspace, void* ctx)
+{
+    (void) workspace;
+    const pattern_t* pat = ctx;
+    grep_result_t* r = result;
     int ovector[3];
-    size_t count = 0;
+    seq_t* seq;
+    size_t i;
 
-    fastq_t* fqf = fastq_create(fin);
-    seq_t* seq = seq_create();
-
-    while (fastq_read(fqf, seq)) {
-        rc = pcre_exec(re,          /* pattern */
-                       NULL,        /* extra data */
-                       id_flag ? seq->id1.s : seq->seq.s,
-                       id_flag ? seq->id1.n : seq->seq.n,
-                       0,           /* subject offset */
-                       0,           /* options */
-                       ovector,     /* output vector */
-                       3         ); /* output vector length */
+    if (batch->n > r->size) {
+        r->size = batch->n;
+        r->rcs = realloc_or_die(r->rcs, r->size * sizeof(int));
+        r->ovectors = realloc_or_die(r->ovectors, 2 * r->size * sizeof(int));
+    }
+
+    for (i = 0; i < batch->n; ++i) {
+        seq = &batch->seqs[i];
+        if (pat->ac) {
+            r->rcs[i] = fastq_ac_search(pat->ac,
+                                        id_flag ? seq->id1.s : seq->seq.s,
+                                        id_flag ? seq->id1.n : seq->seq.n,
+                                        &r->ovectors[2 * i],
+                                        &r->ovectors[2 * i + 1]);
+            if (r->rcs[i] < 0) r->rcs[i] = PCRE_ERROR_NOMATCH;
+            continue;
+        }
+
+        if (pat->literal &&
+            !fastq_strsearch(pat->literal,
+                             id_flag ? seq->id1.s : seq->seq.s,
+                             id_flag ? seq->id1.n : seq->seq.n)) {
+            r->rcs[i] = PCRE_ERROR_NOMATCH;
+            continue;
+        }
 
+        r->rcs[i] = pcre_exec(pat->re,     /* pattern */
+                              pat->extra,  /* extra data */
+                              id_flag ? seq->id1.s : seq->seq.s,
+                              id_flag ? seq->id1.n : seq->seq.n,
+                              0,           /* subject offset */
+                              0,           /* options */
+                              ovector,     /* output vector */
+                              3         ); /* output vector length */
+        r->ovectors[2 * i]     = ovector[0];
+        r->ovectors[2 * i + 1] = ovector[1];
+    }
+}
+
+
+static FILE* grep_fout;
+static FILE* grep_mismatch_file;
+static size_t grep_count;
+
+
+/* Output the matching entries of a batch. */
+void grep_emit(fastq_batch_t* batch, void* result, void* ctx)
+{
+    const pattern_t* pat = ctx;
+    grep_result_t* r = result;
+    seq_t* seq;
+    int rc;
+    size_t i;
+
+    for (i = 0; i < batch->n; ++i) {
+        seq = &batch->seqs[i];
+        rc = r->rcs[i];
         if ((invert_flag && rc == PCRE_ERROR_NOMATCH) || (!invert_flag && rc >= 0)) {
-            if (count_flag) count++;
-            else            fastq_print_maybe_trim(fout, seq, ovector);
+            if (count_flag) grep_count++;
+            else if (pat->ac && !invert_flag) {
+                fastq_print_maybe_trim(grep_fout, seq, &r->ovectors[2 * i],
+                                       fastq_ac_pattern(pat->ac, rc));
+            }
+            else fastq_print_maybe_trim(grep_fout, seq, &r->ovectors[2 * i], NULL);
         }
-        else if (mismatch_file) {
-            fastq_print(mismatch_file, seq);
+        else if (grep_mismatch_file) {
+            fastq_print(grep_mismatch_file, seq);
         }
     }
+}
+
+
+void fastq_grep(FILE* fin, FILE* fout, FILE* mismatch_file, pattern_t* pat,
+                size_t num_threads)
+{
+    pipeline_t p;
+    p.num_threads   = num_threads;
+    p.work          = grep_batch;
+    p.emit          = grep_emit;
+    p.result_create = grep_result_create;
+    p.result_free   = grep_result_free;
+    p.workspaces    = NULL;
+    p.ctx           = pat;
+
+    grep_fout = fout;
+    grep_mismatch_file = mismatch_file;
+    grep_count = 0;
 
-    seq_free(seq);
+    fastq_t* fqf = fastq_create(fin);
+    fastq_pipeline(fqf, &p);
     fastq_free(fqf);
 
-    if (count_flag) fprintf(fout, "%zu\n", count);
+    if (count_flag) fprintf(fout, "%zu\n", grep_count);
 }
 
 
@@ -124,8 +457,8 @@ int main(int argc, char* argv[])
     SET_BINARY_MODE(stdin);
     SET_BINARY_MODE(stdout);
 
-    const char* pat;
-    pcre* re;
+    const char* pat_str;
+    pattern_t pat;
     const char* pat_error;
     int pat_error_offset;
 
@@ -143,6 +476,8 @@ int main(int argc, char* argv[])
     int opt_idx;
 
     FILE* mismatch_file = NULL;
+    size_t num_threads = 1;
+    const char* patterns_fn = NULL;
 
     static struct option long_options[] =
         {
@@ -153,13 +488,15 @@ int main(int argc, char* argv[])
           {"trim-before",  no_argument, &trim_before_flag,  1},
           {"trim-after",   no_argument, &trim_after_flag,  1},
           {"trim-match",   no_argument, &trim_match_flag,  1},
+          {"threads",      required_argument, NULL, 'p'},
+          {"file",         required_argument, NULL, 'f'},
           {"help",         no_argument, NULL, 'h'},
           {"version",      no_argument, NULL, 'V'},
           {0, 0, 0, 0}
         };
 
     while (1) {
-        opt = getopt_long(argc, argv, "ivmcabthV", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "ivm:cabtp:f:hV", long_options, &opt_idx);
 
         if (opt == -1) break;
 
@@ -202,6 +539,14 @@ int main(int argc, char* argv[])
                 count_flag = 1;
                 break;
 
+            case 'p':
+                num_threads = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                patterns_fn = optarg;
+                break;
+
             case 'h':
                 print_help();
                 return 0;
@@ -230,22 +575,47 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "A pattern must be specified.\n");
-        return 1;
+    pat.re = NULL;
+    pat.extra = NULL;
+    pat.ac = NULL;
+    pat.literal = NULL;
+
+    if (patterns_fn) {
+        pat.ac = read_patterns(patterns_fn);
     }
+    else {
+        if (optind >= argc) {
+            fprintf(stderr, "A pattern must be specified.\n");
+            return 1;
+        }
 
-    pat = argv[optind++];
-    re = pcre_compile( pat, PCRE_CASELESS, &pat_error, &pat_error_offset, NULL );
+        pat_str = argv[optind++];
+        pat.re = pcre_compile( pat_str, PCRE_CASELESS, &pat_error, &pat_error_offset, NULL );
 
-    if (re == NULL) {
-        fprintf(stderr, "Syntax error in PCRE pattern at offset: %d: %s\n",
-                pat_error_offset, pat_error );
-        return 1;
+        if (pat.re == NULL) {
+            fprintf(stderr, "Syntax error in PCRE pattern at offset: %d: %s\n",
+                    pat_error_offset, pat_error );
+            return 1;
+        }
+
+        /* The pattern is compiled and studied once and used for every file. */
+        pat.extra = study_pattern(pat.re);
+
+        /* Most entries do not match, so those that can't are weeded out by
+         * searching for a literal part of the pattern first. */
+        char* lit = malloc_or_die(strlen(pat_str) + 1);
+        size_t lit_len = required_literal(pat_str, lit);
+        if (lit_len >= min_literal_len) {
+            pat.literal = fastq_alloc_strsearch(lit, lit_len);
+        }
+        free(lit);
     }
 
+    if (num_threads < 1) num_threads = 1;
+    fastq_set_inflate_threads((int) num_threads);
+
     if (optind >= argc || (argc - optind == 1 && strcmp(argv[optind],"-") == 0)) {
-        fastq_grep(stdin, stdout, mismatch_file, re);
+        fastq_grep(stdin, stdout, mismatch_file, &pat, num_threads);
     }
     else {
         for (; optind < argc; optind++) {
@@ -255,13 +625,18 @@ int main(int argc, char* argv[])
                 continue;
             }
 
-            fastq_grep(fin, stdout, mismatch_file, re);
+            fastq_grep(fin, stdout, mismatch_file, &pat, num_threads);
 
             fclose(fin);
         }
     }
 
-    pcre_free(re);
+    if (pat.ac) fastq_free_ac(pat.ac);
+    else {
+        free_pattern_extra(pat.extra);
+        pcre_free(pat.re);
+        if (pat.literal) fastq_free_strsearch(pat.literal);
+    }
     if (mismatch_file) fclose(mismatch_file);
 
     return 0;
@@ -10,11 +10,16 @@
  */
 
 #include "common.h"
+#include "kmer_table.h"
+#include "nucleotide.h"
 #include "parse.h"
+#include "pipeline.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <getopt.h>
 #include <zlib.h>
 
@@ -33,10 +38,21 @@ void print_help()
 {
     fprintf( stderr, 
 "fastq-kmers [OPTION]... [FILE]...\n"
+"fastq-kmers --merge [OPTION]... FILE...\n"
 "Print kmer counts for the given kmer size.\n"
-"Output is in two tab-seperated columns for kmer and frequency.\n\n"
+"Output is in two tab-seperated columns for kmer and frequency.\n"
+"For k greater than 16, only k-mers that occur are output.\n\n"
 "Options:\n"
 "  -k NUM, --size=NUM      kmer size (default: 1)\n"
+"  -c, --canonical         count each k-mer together with its reverse\n"
+"                          complement, as the lesser of the two\n"
+"  -s, --sparse            output only k-mers that occur\n"
+"  -f, --format=FORMAT     output format: 'text' or 'binary', which is\n"
+"                          every count in order as a 32-bit integer, or\n"
+"                          if sparse, each k-mer that occurs and its count\n"
+"  -m, --merge             sum binary counts from the given files, rather\n"
+"                          than counting k-mers\n"
+"  -p, --threads=NUM       number of threads to count with (default: 1)\n"
 "  -h, --help              print this message\n"
 "  -V, --version           output version information and exit\n"
     );
@@ -44,105 +60,580 @@ void print_help()
 
 static int k;
 
-int packkmer( const char* s, uint32_t* kmer, int k )
+/* Count k-mers and their reverse complements as one. */
+static int canonical_flag;
+
+/* Print only k-mers that occur. */
+static int sparse_flag;
+
+/* Print counts in binary rather than as text. */
+static int binary_flag;
+
+/* Sum binary counts rather than counting k-mers. */
+static int merge_flag;
+
+/* Largest k for which every possible k-mer is counted in an array. Larger ones
+ * are counted in a hash table. */
+#define DENSE_MAX_K 16
+
+/* Counts of one thread: every k-mer in a dense array, or a hash table for each
+ * partition of the k-mers. */
+typedef struct
 {
-    *kmer = 0;
-    uint32_t nt;
-    while (k--) {
-        switch (s[k]) {
-            case 'a':
-            case 'A':
-                nt = 0;
-                break;
-            case 'c':
-            case 'C':
-                nt = 1;
-                break;
-            case 'g':
-            case 'G':
-                nt = 2;
-                break;
-            case 't':
-            case 'T':
-                nt = 3;
-                break;
+    uint32_t* cs;
+    kmer_table** Ts;
+    unsigned char* codes;
+    size_t codes_size;
+} kmer_counts_t;
 
-            default:
-                return 0;
+/* Largest k for which each thread counts into its own dense array. Beyond
+ * that, every thread shares one, incremented atomically. */
+#define LOCAL_MAX_K 12
+
+/* Whether threads share the dense array. */
+static int shared_cs;
+
+/* Hashed k-mers are partitioned by their highest bits, so that partitions can
+ * be merged independently, and then output in order. */
+static size_t num_partitions = 1;
+static int partition_shift;
+
+
+/* K-mers are packed two bits per nucleotide, with the first in the lowest
+ * bits, and are rolled along each read, shifting out the oldest nucleotide and
+ * shifting in the next, with any unknown nucleotide restarting the window.
+ *
+ * For canonical k-mers, the k-mer is also rolled in the opposite order, with
+ * the first nucleotide in the highest bits, where numeric order is
+ * lexicographic order. Since the complement of code c is 3 - c, or c ^ 3, the
+ * reverse complement in either order is just the complement of the k-mer in
+ * the other. */
+void count_batch_kmers(fastq_batch_t* batch, void* result, void* workspace,
+                       void* ctx)
+{
+    (void) result;
+    (void) ctx;
+    kmer_counts_t* c = workspace;
+    seq_t* seq;
+    size_t j;
+    int i;
+    int run;
+    const int shift = 2 * (k - 1);
+    const uint64_t mask = num_partitions - 1;
+    const uint64_t kmask = k == 32 ? ~(uint64_t) 0 : ((uint64_t) 1 << (2*k)) - 1;
+    uint64_t kmer, rkmer, key;
+
+    for (j = 0; j < batch->n; ++j) {
+        seq = &batch->seqs[j];
+        if ((int) seq->seq.n < k) continue;
+
+        if (seq->seq.n > c->codes_size) {
+            c->codes_size = seq->seq.n;
+            c->codes = realloc_or_die(c->codes, c->codes_size);
         }
+        fastq_nt_encode(c->codes, seq->seq.s, seq->seq.n);
 
-        *kmer = (*kmer << 2) | nt;
+        kmer = rkmer = 0;
+        run = 0;
+        for (i = 0; i < (int) seq->seq.n; i++) {
+            if (c->codes[i] & FASTQ_NT_N) {
+                run = 0;
+                continue;
+            }
+
+            kmer = (kmer >> 2) | ((uint64_t) c->codes[i] << shift);
+            if (canonical_flag) {
+                rkmer = ((rkmer << 2) | c->codes[i]) & kmask;
+            }
+            if (++run < k) continue;
+
+            key = kmer;
+            if (canonical_flag && (kmer ^ kmask) < rkmer) key = rkmer ^ kmask;
+
+            if (c->Ts) inc_kmer_table(c->Ts[(key >> partition_shift) & mask], key);
+            else if (shared_cs) __sync_fetch_and_add(&c->cs[key], 1);
+            else c->cs[key]++;
+        }
     }
+}
+
+
+void count_fastq_kmers(FILE* fin, kmer_counts_t* counts, size_t num_threads)
+{
+    size_t i;
+    void** ws = malloc_or_die(num_threads * sizeof(void*));
+    for (i = 0; i < num_threads; ++i) ws[i] = &counts[i];
+
+    pipeline_t p;
+    p.num_threads   = num_threads;
+    p.work          = count_batch_kmers;
+    p.emit          = NULL;
+    p.result_create = NULL;
+    p.result_free   = NULL;
+    p.workspaces    = ws;
+    p.ctx           = NULL;
+
+    fastq_t* fqf = fastq_create(fin);
+    fastq_pipeline(fqf, &p);
+    fastq_free(fqf);
 
-    return 1;
+    free(ws);
 }
 
 
-void unpackkmer( uint32_t kmer, char* s, int k )
+typedef struct
 {
-    int i;
-    uint32_t nt;
-    for (i = 0; i < k; i++, s++) {
-        nt = kmer & 0x3;
-        kmer = kmer >> 2;
+    kmer_counts_t* counts;
+    size_t num_threads;
+    size_t i;
+} merge_arg_t;
 
-        switch (nt) {
-            case 0:
-                *s = 'A';
-                break;
-            case 1:
-                *s = 'C';
-                break;
-            case 2:
-                *s = 'G';
-                break;
-            case 3:
-                *s = 'T';
-                break;
-            default: break;
+
+/* Sum the counts of every thread into those of the first, dividing the work
+ * evenly between threads. */
+static void* merge_thread(void* arg_)
+{
+    merge_arg_t* arg = arg_;
+    kmer_counts_t* counts = arg->counts;
+    size_t num_threads = arg->num_threads;
+    size_t i, t, u;
+
+    if (counts[0].Ts) {
+        kmer_table* T;
+        for (i = arg->i; i < num_partitions; i += num_threads) {
+            for (t = 1; t < num_threads; ++t) {
+                T = counts[t].Ts[i];
+                for (u = 0; u < T->n; ++u) {
+                    if (T->A[u].count) {
+                        add_kmer_table(counts[0].Ts[i], T->A[u].kmer, T->A[u].count);
+                    }
+                }
+                destroy_kmer_table(T);
+                counts[t].Ts[i] = NULL;
+            }
+        }
+    }
+    else {
+        size_t n = (size_t) 1 << (2*k);
+        size_t from = n / num_threads * arg->i;
+        size_t to = arg->i + 1 == num_threads ? n : n / num_threads * (arg->i + 1);
+        for (t = 1; t < num_threads; ++t) {
+            for (u = from; u < to; ++u) counts[0].cs[u] += counts[t].cs[u];
         }
     }
 
-    *s = '\0';
+    return NULL;
 }
 
 
-void count_fastq_kmers(FILE* fin, uint32_t* cs)
+void merge_counts(kmer_counts_t* counts, size_t num_threads)
 {
-    seq_t* seq = seq_create();
-    fastq_t* fqf = fastq_create(fin);
+    size_t i;
+    merge_arg_t* args = malloc_or_die(num_threads * sizeof(merge_arg_t));
+    pthread_t* threads = malloc_or_die(num_threads * sizeof(pthread_t));
+
+    for (i = 0; i < num_threads; ++i) {
+        args[i].counts = counts;
+        args[i].num_threads = num_threads;
+        args[i].i = i;
+        if (pthread_create(&threads[i], NULL, merge_thread, &args[i]) != 0) {
+            fprintf(stderr, "Unable to create a thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(args);
+}
+
+
+/* True if a k-mer is no greater than its reverse complement. */
+static bool is_canonical(uint64_t kmer)
+{
+    uint64_t rkmer = 0, fkmer = kmer;
     int i;
-    int n;
-    uint32_t kmer;
+    for (i = 0; i < k; i++, kmer >>= 2) {
+        rkmer = (rkmer << 2) | ((kmer & 3) ^ 3);
+    }
+
+    /* compare in lexicographic order, i.e., with the first nucleotide in the
+     * highest bits */
+    uint64_t fhigh = 0, rhigh = 0;
+    for (i = 0; i < k; i++, fkmer >>= 2, rkmer >>= 2) {
+        fhigh = (fhigh << 2) | (fkmer & 3);
+        rhigh = (rhigh << 2) | (rkmer & 3);
+    }
+
+    return fhigh <= rhigh;
+}
+
+
+/* Counts are output in increasing order of k-mer through a writer, which
+ * formats them into a buffer, written whenever full, and, for dense output,
+ * fills in zero counts between the k-mers given.
+ *
+ * Binary output is a 16-byte header of the magic bytes "FQKM", then k, a set
+ * of flags, and four bytes of zero padding, followed by the counts. With the
+ * FLAG_SPARSE flag, these are only nonzero counts, each in a 16-byte record of
+ * its k-mer, the count, and four bytes of zero padding; otherwise they are the
+ * count of every k-mer in order. Numbers are little-endian, k, flags and
+ * counts being 32-bit unsigned integers, and k-mers 64-bit, so that every
+ * number is aligned to its size. Being sorted and of fixed width, the counts
+ * can be mapped into memory and searched in place, or merged without being
+ * read whole. */
+typedef struct
+{
+    FILE* f;
+    char* buf;
+    size_t n;
+    bool dense;
+    uint64_t next; /* next k-mer to output, if dense */
+} kmer_writer_t;
+
+#define OUTBUF_SIZE 0x100000
+
+static const char binary_magic[4] = {'F', 'Q', 'K', 'M'};
+
+#define FLAG_CANONICAL 0x1
+#define FLAG_SPARSE    0x2
+
+#define HEADER_SIZE 16
+#define SPARSE_RECORD_SIZE 16
+
+
+static void put_le32(unsigned char* buf, uint32_t x)
+{
+    buf[0] = x & 0xff;
+    buf[1] = (x >> 8) & 0xff;
+    buf[2] = (x >> 16) & 0xff;
+    buf[3] = (x >> 24) & 0xff;
+}
+
+
+static void put_le64(unsigned char* buf, uint64_t x)
+{
+    put_le32(buf, (uint32_t) x);
+    put_le32(buf + 4, (uint32_t) (x >> 32));
+}
+
+
+static uint32_t get_le32(const unsigned char* buf)
+{
+    return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+           ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+
+static uint64_t get_le64(const unsigned char* buf)
+{
+    return (uint64_t) get_le32(buf) | ((uint64_t) get_le32(buf + 4) << 32);
+}
+
+
+static void writer_flush(kmer_writer_t* w)
+{
+    if (w->n > 0 && fwrite(w->buf, 1, w->n, w->f) != w->n) {
+        fprintf(stderr, "Error writing output.\n");
+        exit(EXIT_FAILURE);
+    }
+    w->n = 0;
+}
+
+
+static void writer_open(kmer_writer_t* w, FILE* fout)
+{
+    static const char text_header[] = "kmer\tfrequency\n";
+
+    w->f = fout;
+    w->buf = malloc_or_die(OUTBUF_SIZE);
+    w->n = 0;
+    w->dense = !sparse_flag && k <= DENSE_MAX_K;
+    w->next = 0;
+
+    if (binary_flag) {
+        memcpy(w->buf, binary_magic, 4);
+        put_le32((unsigned char*) w->buf + 4, k);
+        put_le32((unsigned char*) w->buf + 8,
+                 (canonical_flag ? FLAG_CANONICAL : 0) |
+                 (w->dense ? 0 : FLAG_SPARSE));
+        put_le32((unsigned char*) w->buf + 12, 0);
+        w->n = HEADER_SIZE;
+    }
+    else {
+        memcpy(w->buf, text_header, sizeof(text_header) - 1);
+        w->n = sizeof(text_header) - 1;
+    }
+}
+
+
+static void writer_emit(kmer_writer_t* w, uint64_t kmer, uint32_t count)
+{
+    static const char nts[4] = {'A', 'C', 'G', 'T'};
+    char digits[10];
+    char* s;
+    int i, m;
+
+    if (binary_flag) {
+        if (w->n + SPARSE_RECORD_SIZE > OUTBUF_SIZE) writer_flush(w);
+        s = w->buf + w->n;
+        if (w->dense) {
+            put_le32((unsigned char*) s, count);
+            w->n += 4;
+        }
+        else {
+            put_le64((unsigned char*) s, kmer);
+            put_le32((unsigned char*) s + 8, count);
+            put_le32((unsigned char*) s + 12, 0);
+            w->n += SPARSE_RECORD_SIZE;
+        }
+        return;
+    }
+
+    /* only canonical k-mers are listed, and others are never counted */
+    if (count == 0 && canonical_flag && !is_canonical(kmer)) return;
 
-    while (fastq_read(fqf, seq)) {
-        n = (int)seq->seq.n - k + 1;
+    /* a k-mer, tab, at most 10 digits, and newline */
+    if (w->n + k + 12 > OUTBUF_SIZE) writer_flush(w);
+
+    s = w->buf + w->n;
+    for (i = 0; i < k; i++, kmer >>= 2) *s++ = nts[kmer & 3];
+    *s++ = '\t';
+
+    m = 0;
+    do {
+        digits[m++] = '0' + count % 10;
+        count /= 10;
+    } while (count);
+    while (m) *s++ = digits[--m];
+    *s++ = '\n';
+
+    w->n = s - w->buf;
+}
+
+
+/* Output a k-mer's count, k-mers being given in increasing order. */
+static void writer_put(kmer_writer_t* w, uint64_t kmer, uint32_t count)
+{
+    if (w->dense) {
+        while (w->next < kmer) writer_emit(w, w->next++, 0);
+        writer_emit(w, kmer, count);
+        w->next = kmer + 1;
+    }
+    else if (count) writer_emit(w, kmer, count);
+}
+
+
+static void writer_close(kmer_writer_t* w)
+{
+    if (w->dense) {
+        uint64_t n = (uint64_t) 1 << (2*k); /* 4^k */
+        while (w->next < n) writer_emit(w, w->next++, 0);
+    }
+
+    writer_flush(w);
+    free(w->buf);
+}
+
+
+void print_kmer_freqs(FILE* fout, uint32_t* cs)
+{
+    uint64_t n = (uint64_t) 1 << (2*k); /* 4^k */
+    uint64_t kmer;
+    kmer_writer_t w;
+
+    writer_open(&w, fout);
+    for (kmer = 0; kmer < n; kmer++) writer_put(&w, kmer, cs[kmer]);
+    writer_close(&w);
+}
+
+
+void print_kmer_table(FILE* fout, kmer_table** Ts)
+{
+    size_t n;
+    size_t i, p;
+    kmer_writer_t w;
+
+    writer_open(&w, fout);
+    for (p = 0; p < num_partitions; p++) {
+        n = sort_kmer_table(Ts[p]);
         for (i = 0; i < n; i++) {
-            if( packkmer(seq->seq.s + i, &kmer, k) ) {
-                cs[kmer]++;
+            writer_put(&w, Ts[p]->A[i].kmer, Ts[p]->A[i].count);
+        }
+    }
+    writer_close(&w);
+}
+
+
+/* A reader of binary output, giving the nonzero counts in order. */
+typedef struct
+{
+    const char* fn;
+    FILE* f;
+    unsigned char* buf;
+    size_t off, n;
+    int k;
+    uint32_t flags;
+    uint64_t next; /* next k-mer to read, if dense */
+    uint64_t kmer;
+    uint32_t count;
+} kmer_reader_t;
+
+#define INBUF_SIZE 0x10000
+
+
+/* Return the next len bytes of input, or NULL at its end. */
+static const unsigned char* reader_bytes(kmer_reader_t* r, size_t len)
+{
+    if (r->n - r->off < len) {
+        memmove(r->buf, r->buf + r->off, r->n - r->off);
+        r->n -= r->off;
+        r->off = 0;
+        r->n += fread(r->buf + r->n, 1, INBUF_SIZE - r->n, r->f);
+        if (r->n < len) {
+            if (r->n > 0) {
+                fprintf(stderr, "Truncated k-mer counts in '%s'.\n", r->fn);
+                exit(EXIT_FAILURE);
             }
+            return NULL;
         }
     }
 
-    seq_free(seq);
-    fastq_free(fqf);
+    r->off += len;
+    return r->buf + r->off - len;
 }
 
 
-void print_kmer_freqs(FILE* fout, uint32_t* cs)
+static void reader_open(kmer_reader_t* r, const char* fn)
+{
+    const unsigned char* header;
+
+    r->fn = fn;
+    r->f = fopen(fn, "rb");
+    if (r->f == NULL) {
+        fprintf(stderr, "No such file '%s'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+
+    r->buf = malloc_or_die(INBUF_SIZE);
+    r->off = r->n = 0;
+    r->next = 0;
+
+    header = reader_bytes(r, HEADER_SIZE);
+    if (header == NULL || memcmp(header, binary_magic, 4) != 0) {
+        fprintf(stderr, "'%s' is not binary k-mer counts.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+
+    r->k = (int) get_le32(header + 4);
+    r->flags = get_le32(header + 8);
+    if (r->k < 1 || r->k > 32 || (r->k > DENSE_MAX_K && !(r->flags & FLAG_SPARSE))) {
+        fprintf(stderr, "Invalid k-mer counts in '%s'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void reader_close(kmer_reader_t* r)
+{
+    fclose(r->f);
+    free(r->buf);
+}
+
+
+/* Advance to the next nonzero count, returning false if there is none. */
+static bool reader_next(kmer_reader_t* r)
+{
+    const unsigned char* rec;
+
+    if (r->flags & FLAG_SPARSE) {
+        uint64_t prev = r->kmer;
+        bool first = r->next == 0;
+        if ((rec = reader_bytes(r, SPARSE_RECORD_SIZE)) == NULL) return false;
+        r->kmer = get_le64(rec);
+        r->count = get_le32(rec + 8);
+        r->next = 1;
+        if (!first && r->kmer <= prev) {
+            fprintf(stderr, "Unsorted k-mer counts in '%s'.\n", r->fn);
+            exit(EXIT_FAILURE);
+        }
+        return true;
+    }
+
+    uint64_t n = (uint64_t) 1 << (2*r->k); /* 4^k */
+    while (r->next < n) {
+        if ((rec = reader_bytes(r, 4)) == NULL) {
+            fprintf(stderr, "Truncated k-mer counts in '%s'.\n", r->fn);
+            exit(EXIT_FAILURE);
+        }
+        r->kmer = r->next++;
+        r->count = get_le32(rec);
+        if (r->count) return true;
+    }
+
+    return false;
+}
+
+
+/* Restore the order of a heap of readers, by least k-mer, from position i. */
+static void sift_down(kmer_reader_t** H, size_t n, size_t i)
 {
-    uint32_t n = 1 << (2*k); /* 4^k */
+    size_t j;
+    kmer_reader_t* r;
+    while ((j = 2 * i + 1) < n) {
+        if (j + 1 < n && H[j + 1]->kmer < H[j]->kmer) ++j;
+        if (H[i]->kmer <= H[j]->kmer) break;
+        r = H[i]; H[i] = H[j]; H[j] = r;
+        i = j;
+    }
+}
+
+
+/* Sum binary k-mer counts, merging them in order so that no more than the
+ * next count of each is held at once. */
+void merge_kmer_files(FILE* fout, char** fns, size_t num_files)
+{
+    kmer_reader_t* rs = malloc_or_die(num_files * sizeof(kmer_reader_t));
+    kmer_reader_t** H = malloc_or_die(num_files * sizeof(kmer_reader_t*));
+    size_t i, n = 0;
+    uint64_t kmer, sum;
+    kmer_writer_t w;
+
+    for (i = 0; i < num_files; ++i) {
+        reader_open(&rs[i], fns[i]);
+        if (rs[i].k != rs[0].k ||
+            (rs[i].flags & FLAG_CANONICAL) != (rs[0].flags & FLAG_CANONICAL)) {
+            fprintf(stderr, "K-mer counts in '%s' and '%s' are of different kinds.\n",
+                    fns[0], fns[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (reader_next(&rs[i])) H[n++] = &rs[i];
+    }
+
+    k = rs[0].k;
+    canonical_flag = (rs[0].flags & FLAG_CANONICAL) != 0;
 
-    char* kmer_str = malloc((k+1)*sizeof(char));
-    uint32_t kmer;
+    i = n / 2;
+    while (i-- > 0) sift_down(H, n, i);
+
+    writer_open(&w, fout);
+    while (n > 0) {
+        kmer = H[0]->kmer;
+        sum = 0;
+        while (n > 0 && H[0]->kmer == kmer) {
+            sum += H[0]->count;
+            if (!reader_next(H[0])) H[0] = H[--n];
+            sift_down(H, n, 0);
+        }
 
-    fprintf(fout, "kmer\tfrequency\n");
-    for (kmer = 0; kmer < n; kmer++) {
-        unpackkmer(kmer, kmer_str, k);
-        fprintf(fout, "%s\t%u\n", kmer_str, cs[kmer]);
+        writer_put(&w, kmer, sum > UINT32_MAX ? UINT32_MAX : (uint32_t) sum);
     }
+    writer_close(&w);
 
-    free(kmer_str);
+    for (i = 0; i < num_files; ++i) reader_close(&rs[i]);
+    free(H);
+    free(rs);
 }
 
 
@@ -153,8 +644,10 @@ int main(int argc, char* argv[])
 
     k = 1;
 
-    uint32_t n;   /* number of kmers: 4^k */
-    uint32_t* cs; /* counts */
+    size_t n;     /* number of kmers: 4^k */
+    kmer_counts_t* counts; /* for each thread */
+    size_t num_threads = 1;
+    size_t i, p;
 
     FILE* fin;
 
@@ -162,31 +655,56 @@ int main(int argc, char* argv[])
     int opt_idx;
     static struct option long_options[] =
         { 
-          {"size", no_argument,    0, 0},
+          {"size", required_argument, 0, 'k'},
+          {"threads", required_argument, 0, 'p'},
+          {"canonical", no_argument, 0, 'c'},
+          {"sparse", no_argument, 0, 's'},
+          {"format", required_argument, 0, 'f'},
+          {"merge", no_argument, 0, 'm'},
           {"help", no_argument,    0, 'h'},
           {"version", no_argument, 0, 'V'},
           {0, 0, 0, 0}
         };
 
     while (1) {
-        opt = getopt_long(argc, argv, "k:hV", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "k:p:csf:mhV", long_options, &opt_idx);
 
         if( opt == -1 ) break;
 
         switch (opt) {
             case 0:
                 if (long_options[opt_idx].flag != 0) break;
-                if (optarg) {
-                    if( opt_idx == 1 ) {
-                        k = atoi(optarg);
-                    }
-                }
                 break;
 
             case 'k':
                 k = atoi(optarg);
                 break;
 
+            case 'p':
+                num_threads = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
+            case 'c':
+                canonical_flag = 1;
+                break;
+
+            case 's':
+                sparse_flag = 1;
+                break;
+
+            case 'f':
+                if (strcmp(optarg, "binary") == 0) binary_flag = 1;
+                else if (strcmp(optarg, "text") == 0) binary_flag = 0;
+                else {
+                    fprintf(stderr, "Unknown output format '%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                merge_flag = 1;
+                break;
+
             case 'h':
                 print_help();
                 return 0;
@@ -203,28 +721,71 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (merge_flag) {
+        if (optind >= argc) {
+            fprintf(stderr, "No k-mer counts to merge.\n");
+            return 1;
+        }
+
+        merge_kmer_files(stdout, argv + optind, argc - optind);
+        return 0;
+    }
+
     if (k < 1) {
         fprintf(stderr, "Kmer size must be at least 1.");
         return 1;
     }
 
-    if (k > 16) {
-        fprintf(stderr, "Kmer size must be at most 16.");
+    if (k > 32) {
+        fprintf(stderr, "Kmer size must be at most 32.");
         return 1;
     }
 
 
-    n = 1 << (2*k); /* i.e. 4^k */
-    cs = malloc(n * sizeof(uint32_t));
-    memset(cs, 0, n * sizeof(uint32_t));
+    if (num_threads < 1) num_threads = 1;
+    fastq_set_inflate_threads((int) num_threads);
+    counts = malloc_or_die(num_threads * sizeof(kmer_counts_t));
+    for (i = 0; i < num_threads; ++i) {
+        counts[i].cs = NULL;
+        counts[i].Ts = NULL;
+        counts[i].codes = NULL;
+        counts[i].codes_size = 0;
+    }
+
+    if (k <= DENSE_MAX_K) {
+        n = (size_t) 1 << (2*k); /* i.e. 4^k */
+        shared_cs = num_threads > 1 && k > LOCAL_MAX_K;
 
-    if (cs == NULL) {
-        fprintf(stderr, "Insufficient memory to tally kmers of size %d\n", k );
-        return 1;
+        for (i = 0; i < num_threads; ++i) {
+            if (i > 0 && shared_cs) {
+                counts[i].cs = counts[0].cs;
+                continue;
+            }
+
+            counts[i].cs = malloc(n * sizeof(uint32_t));
+            if (counts[i].cs == NULL) {
+                fprintf(stderr, "Insufficient memory to tally kmers of size %d\n", k );
+                return 1;
+            }
+            memset(counts[i].cs, 0, n * sizeof(uint32_t));
+        }
+    }
+    else {
+        int bits = 0;
+        while (((size_t) 1 << bits) < num_threads) ++bits;
+        num_partitions = (size_t) 1 << bits;
+        partition_shift = bits ? 2*k - bits : 0;
+
+        for (i = 0; i < num_threads; ++i) {
+            counts[i].Ts = malloc_or_die(num_partitions * sizeof(kmer_table*));
+            for (p = 0; p < num_partitions; ++p) {
+                counts[i].Ts[p] = create_kmer_table();
+            }
+        }
     }
 
     if (optind >= argc || (argc - optind == 1 && strcmp(argv[optind],"-") == 0)) {
-        count_fastq_kmers(stdin, cs);
+        count_fastq_kmers(stdin, counts, num_threads);
     }
     else {
         for (; optind < argc; optind++) {
@@ -234,12 +795,24 @@ int main(int argc, char* argv[])
                 continue;
             }
 
-            count_fastq_kmers(fin, cs);
+            count_fastq_kmers(fin, counts, num_threads);
         }
     }
 
-    print_kmer_freqs( stdout, cs );
-    free(cs);
+    if (num_threads > 1 && !shared_cs) merge_counts(counts, num_threads);
+
+    if (counts[0].cs) print_kmer_freqs( stdout, counts[0].cs );
+    else              print_kmer_table( stdout, counts[0].Ts );
+
+    for (i = 0; i < num_threads; ++i) {
+        if (i == 0 || !shared_cs) free(counts[i].cs);
+        if (counts[i].Ts) {
+            for (p = 0; p < num_partitions; ++p) destroy_kmer_table(counts[i].Ts[p]);
+            free(counts[i].Ts);
+        }
+        free(counts[i].codes);
+    }
+    free(counts);
 
     return 0;
 }
@@ -12,7 +12,9 @@
 
 #include "common.h"
 #include "parse.h"
+#include "pipeline.h"
 #include "sw.h"
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
@@ -29,38 +31,352 @@
 
 static const char* prog_name = "fastq-match";
 
+/* Print entries scoring at least min_score, rather than every score. */
+static int min_score_flag;
+static int min_score;
+
+/* With min_score, print where and how each entry aligns. */
+static int cigar_flag;
+
+/* Match by edit distance, printing entries within max_edits. */
+static int max_edits_flag;
+static int max_edits;
+
 
 void print_help()
 {
     fprintf(stdout, 
 "fastq-match [OPTION]... QUERY [FILE]...\n"
+"fastq-match [OPTION]... -q QUERIES_FILE [FILE]...\n"
 "Perform Smith-Waterman local alignment of a query sequence\n"
 "against each sequence in a fastq file.\n\n"
 "Options:\n"
+"  -q, --queries=FILE      align against every sequence in the FASTA file FILE,\n"
+"                          reporting the best scoring one\n"
+"  -s, --min-score=S       output only entries scoring at least S, in full\n"
+"  -c, --cigar             with -s, output the read ID, score, aligned positions\n"
+"                          in the read and query, and CIGAR string of each\n"
+"                          entry, rather than the entry itself\n"
+"  -k, --max-edits=K       match by edit distance rather than alignment score,\n"
+"                          outputting entries within K edits of the query\n"
+"  -p, --threads=NUM       number of threads to align with (default: 1)\n"
 "  -h, --help              print this message\n"
 "  -V, --version           output version information and exit\n"
     );
 }
 
 
-void fastq_match(FILE* fin, FILE* fout, sw_t* sw)
+/* Query sequences, converted for fastq_sw, and their names, which are NULL
+ * for a query given on the command line. When matching by edit distance, eds
+ * holds a matcher for each, which, unlike a sw_t, can be shared by every
+ * worker. */
+typedef struct
 {
-    int score;
+    unsigned char** seqs;
+    int* lens;
+    char** names;
+    edit_t** eds;
+    size_t n;
+    size_t size;
+} queries_t;
 
-    fastq_t* fqf = fastq_create(fin);
-    seq_t* seq = seq_create();
 
-    while (fastq_read(fqf, seq)) {
-        fprintf(fout, "%s\t", seq->seq.s);
+static void queries_add(queries_t* qs, char* name, unsigned char* seq, int len)
+{
+    if (qs->n == qs->size) {
+        qs->size = qs->size ? 2 * qs->size : 16;
+        qs->seqs  = realloc_or_die(qs->seqs, qs->size * sizeof(unsigned char*));
+        qs->lens  = realloc_or_die(qs->lens, qs->size * sizeof(int));
+        qs->names = realloc_or_die(qs->names, qs->size * sizeof(char*));
+    }
+
+    fastq_sw_conv_seq(seq, len);
+    qs->seqs[qs->n]  = seq;
+    qs->lens[qs->n]  = len;
+    qs->names[qs->n] = name;
+    qs->n++;
+}
 
-        fastq_sw_conv_seq((unsigned char*)seq->seq.s, seq->seq.n);
-        score = fastq_sw(sw, (unsigned char*)seq->seq.s, seq->seq.n);
 
-        fprintf(fout, "%d\n", score);
+/* Read queries from a FASTA file, naming each by the first word of its
+ * header. */
+static void read_queries(queries_t* qs, const char* fn)
+{
+    FILE* f = fopen(fn, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "No such file '%s'.\n", fn);
+        exit(EXIT_FAILURE);
     }
 
-    seq_free(seq);
+    size_t line_size = 4096;
+    char* line = malloc_or_die(line_size);
+    char* name = NULL;
+    unsigned char* seq = NULL;
+    size_t len = 0, size = 0, n;
+
+    while (fgets(line, line_size, f)) {
+        n = strlen(line);
+
+        /* read the rest of a line too long for the buffer */
+        while (n > 0 && line[n - 1] != '\n' && !feof(f)) {
+            line_size *= 2;
+            line = realloc_or_die(line, line_size);
+            if (fgets(line + n, line_size - n, f) == NULL) break;
+            n += strlen(line + n);
+        }
+
+        while (n > 0 && isspace((unsigned char) line[n - 1])) --n;
+        line[n] = '\0';
+
+        if (line[0] == '>') {
+            if (name) queries_add(qs, name, seq, len);
+            n = strcspn(line + 1, " \t");
+            name = malloc_or_die(n + 1);
+            memcpy(name, line + 1, n);
+            name[n] = '\0';
+            size = 256;
+            seq = malloc_or_die(size);
+            len = 0;
+        }
+        else if (name) {
+            if (len + n > size) {
+                while (len + n > size) size *= 2;
+                seq = realloc_or_die(seq, size);
+            }
+            memcpy(seq + len, line, n);
+            len += n;
+        }
+    }
+    if (name) queries_add(qs, name, seq, len);
+    free(line);
+    fclose(f);
+
+    size_t i;
+    for (i = 0; i < qs->n; ++i) {
+        if (qs->lens[i] == 0) {
+            fprintf(stderr, "Query '%s' in '%s' is empty.\n", qs->names[i], fn);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (qs->n == 0) {
+        fprintf(stderr, "No queries found in '%s'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/* Each worker aligns with its own sw_t for each query, which hold the scratch
+ * space of the alignment, and converts sequences into its own buffer, leaving
+ * the batch intact for output. */
+typedef struct
+{
+    sw_t** sws;
+    unsigned char* seq;
+    size_t size;
+} match_workspace_t;
+
+
+typedef struct
+{
+    int* scores;  /* score, or edit distance */
+    int* queries; /* the best scoring query for each entry */
+    int* ends;    /* end of the best match, by edit distance */
+    size_t size;
+
+    /* with cigar_flag, the start and end in the read and query of each
+     * entry's alignment, and its CIGAR string, at an offset into cigars */
+    int* coords;
+    size_t* cigar_offs;
+    char* cigars;
+    size_t cigars_len, cigars_size;
+} match_result_t;
+
+
+void* match_result_create(void* ctx)
+{
+    (void) ctx;
+    match_result_t* r = malloc_or_die(sizeof(match_result_t));
+    r->size = 1024;
+    r->scores = malloc_or_die(r->size * sizeof(int));
+    r->queries = malloc_or_die(r->size * sizeof(int));
+    r->ends = malloc_or_die(r->size * sizeof(int));
+    r->coords = malloc_or_die(4 * r->size * sizeof(int));
+    r->cigar_offs = malloc_or_die(r->size * sizeof(size_t));
+    r->cigars_size = 4096;
+    r->cigars = malloc_or_die(r->cigars_size);
+    return r;
+}
+
+
+void match_result_free(void* result, void* ctx)
+{
+    (void) ctx;
+    match_result_t* r = result;
+    free(r->scores);
+    free(r->queries);
+    free(r->ends);
+    free(r->coords);
+    free(r->cigar_offs);
+    free(r->cigars);
+    free(r);
+}
+
+
+/* Align every entry in a batch against every query. */
+void match_batch(fastq_batch_t* batch, void* result, void* workspace, void* ctx)
+{
+    const queries_t* qs = ctx;
+    match_result_t* r = result;
+    match_workspace_t* w = workspace;
+    seq_t* seq;
+    size_t i, k;
+    int score, best, end;
+    sw_alignment_t aln;
+    size_t len;
+
+    if (batch->n > r->size) {
+        r->size = batch->n;
+        r->scores = realloc_or_die(r->scores, r->size * sizeof(int));
+        r->queries = realloc_or_die(r->queries, r->size * sizeof(int));
+        r->ends = realloc_or_die(r->ends, r->size * sizeof(int));
+        r->coords = realloc_or_die(r->coords, 4 * r->size * sizeof(int));
+        r->cigar_offs = realloc_or_die(r->cigar_offs, r->size * sizeof(size_t));
+    }
+    r->cigars_len = 0;
+
+    for (i = 0; i < batch->n; ++i) {
+        seq = &batch->seqs[i];
+        if (seq->seq.n > w->size) {
+            w->size = seq->seq.n;
+            w->seq = realloc_or_die(w->seq, w->size);
+        }
+
+        memcpy(w->seq, seq->seq.s, seq->seq.n);
+        fastq_sw_conv_seq(w->seq, seq->seq.n);
+
+        if (max_edits_flag) {
+            best = fastq_edit(qs->eds[0], w->seq, seq->seq.n, &r->ends[i]);
+            r->queries[i] = 0;
+            for (k = 1; k < qs->n && best > 0; ++k) {
+                score = fastq_edit(qs->eds[k], w->seq, seq->seq.n, &end);
+                if (score < best) {
+                    best = score;
+                    r->ends[i] = end;
+                    r->queries[i] = k;
+                }
+            }
+
+            r->scores[i] = best;
+            continue;
+        }
+
+        /* After the first query, only a better score is of interest, so the
+         * others can give up early. */
+        best = min_score_flag ?
+            fastq_sw_min(w->sws[0], w->seq, seq->seq.n, min_score) :
+            fastq_sw(w->sws[0], w->seq, seq->seq.n);
+        r->queries[i] = 0;
+
+        for (k = 1; k < qs->n; ++k) {
+            score = fastq_sw_min(w->sws[k], w->seq, seq->seq.n,
+                                 min_score_flag && min_score > best ?
+                                 min_score : best + 1);
+            if (score > best) {
+                best = score;
+                r->queries[i] = k;
+            }
+        }
+
+        r->scores[i] = best;
+
+        /* Only now, for the few that pass, find the alignment itself. */
+        if (cigar_flag && best >= min_score) {
+            fastq_sw_align(w->sws[r->queries[i]], w->seq, seq->seq.n, &aln);
+            r->coords[4 * i]     = aln.query_start;
+            r->coords[4 * i + 1] = aln.query_end;
+            r->coords[4 * i + 2] = aln.subject_start;
+            r->coords[4 * i + 3] = aln.subject_end;
+
+            len = strlen(aln.cigar) + 1;
+            while (r->cigars_len + len > r->cigars_size) {
+                r->cigars_size *= 2;
+                r->cigars = realloc_or_die(r->cigars, r->cigars_size);
+            }
+            memcpy(r->cigars + r->cigars_len, aln.cigar, len);
+            r->cigar_offs[i] = r->cigars_len;
+            r->cigars_len += len;
+        }
+    }
+}
+
+
+static FILE* match_fout;
+
+
+/* Output the scores of a batch, or the entries scoring high enough, along
+ * with the name of the best scoring query, if it has one. */
+void match_emit(fastq_batch_t* batch, void* result, void* ctx)
+{
+    const queries_t* qs = ctx;
+    match_result_t* r = result;
+    const char* name;
+    seq_t* seq;
+    size_t i;
+
+    for (i = 0; i < batch->n; ++i) {
+        seq = &batch->seqs[i];
+        name = qs->names[r->queries[i]];
+        if (max_edits_flag) {
+            if (r->scores[i] > max_edits) continue;
+            fprintf(match_fout, "%s\t%d\t%d%s%s\n", seq->seq.s, r->scores[i],
+                    r->ends[i], name ? "\t" : "", name ? name : "");
+        }
+        else if (!min_score_flag) {
+            fprintf(match_fout, "%s\t%d%s%s\n", seq->seq.s, r->scores[i],
+                    name ? "\t" : "", name ? name : "");
+        }
+        else if (r->scores[i] < min_score) continue;
+        else if (cigar_flag) {
+            fprintf(match_fout, "%s\t%d\t%d\t%d\t%d\t%d\t%s%s%s\n",
+                    seq->id1.s, r->scores[i],
+                    r->coords[4 * i], r->coords[4 * i + 1],
+                    r->coords[4 * i + 2], r->coords[4 * i + 3],
+                    r->cigars + r->cigar_offs[i],
+                    name ? "\t" : "", name ? name : "");
+        }
+        else if (name) {
+            fprintf(match_fout, "@%s %s\n%s\n+%s\n%s\n",
+                    seq->id1.s, name, seq->seq.s, seq->id2.s, seq->qual.s);
+        }
+        else fastq_print(match_fout, seq);
+    }
+}
+
+
+void fastq_match(FILE* fin, FILE* fout, queries_t* qs,
+                 match_workspace_t* workspaces, size_t num_threads)
+{
+    size_t i;
+    void** ws = malloc_or_die(num_threads * sizeof(void*));
+    for (i = 0; i < num_threads; ++i) ws[i] = &workspaces[i];
+
+    pipeline_t p;
+    p.num_threads   = num_threads;
+    p.work          = match_batch;
+    p.emit          = match_emit;
+    p.result_create = match_result_create;
+    p.result_free   = match_result_free;
+    p.workspaces    = ws;
+    p.ctx           = qs;
+
+    match_fout = fout;
+
+    fastq_t* fqf = fastq_create(fin);
+    fastq_pipeline(fqf, &p);
     fastq_free(fqf);
+
+    free(ws);
 }
 
 
@@ -70,10 +386,12 @@ int main(int argc, char* argv[])
     SET_BINARY_MODE(stdin);
     SET_BINARY_MODE(stdout);
 
-    unsigned char* query;
-    int query_len;
+    queries_t qs;
+    const char* queries_fn = NULL;
 
-    sw_t* sw;
+    size_t num_threads = 1;
+    match_workspace_t* workspaces;
+    size_t i, k;
 
     FILE*  fin;
 
@@ -82,6 +400,11 @@ int main(int argc, char* argv[])
 
     static struct option long_options[] =
         { 
+          {"queries",    required_argument, NULL, 'q'},
+          {"min-score",  required_argument, NULL, 's'},
+          {"cigar",      no_argument,       NULL, 'c'},
+          {"max-edits",  required_argument, NULL, 'k'},
+          {"threads",    required_argument, NULL, 'p'},
           {"help",       no_argument,       NULL, 'h'},
           {"version",    no_argument,       NULL, 'V'},
           {0, 0, 0, 0}
@@ -89,7 +412,7 @@ int main(int argc, char* argv[])
 
 
     while (1) {
-        opt = getopt_long(argc, argv, "hV", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "q:s:ck:p:hV", long_options, &opt_idx);
 
         if (opt == -1) break;
 
@@ -100,6 +423,28 @@ int main(int argc, char* argv[])
                 }
                 break;
 
+            case 'q':
+                queries_fn = optarg;
+                break;
+
+            case 's':
+                min_score_flag = 1;
+                min_score = atoi(optarg);
+                break;
+
+            case 'c':
+                cigar_flag = 1;
+                break;
+
+            case 'k':
+                max_edits_flag = 1;
+                max_edits = atoi(optarg);
+                break;
+
+            case 'p':
+                num_threads = (size_t) strtoul(optarg, NULL, 10);
+                break;
+
             case 'h':
                 print_help();
                 return 0;
@@ -117,19 +462,58 @@ int main(int argc, char* argv[])
     }
 
 
-    if (optind >= argc) {
-        fprintf(stderr, "A query sequence must be specified.\n");
+    if (min_score_flag && max_edits_flag) {
+        fprintf(stderr, "Specify -s or -k, not both.\n");
         return 1;
     }
 
-    query = (unsigned char*)argv[optind++];
-    query_len = strlen((char*)query);
-    fastq_sw_conv_seq(query, query_len);
+    if (cigar_flag && !min_score_flag) {
+        fprintf(stderr, "Alignments are only output with -s.\n");
+        return 1;
+    }
+
+    qs.seqs  = NULL;
+    qs.lens  = NULL;
+    qs.names = NULL;
+    qs.eds   = NULL;
+    qs.n = qs.size = 0;
+
+    if (queries_fn) read_queries(&qs, queries_fn);
+    else {
+        if (optind >= argc) {
+            fprintf(stderr, "A query sequence must be specified.\n");
+            return 1;
+        }
+
+        queries_add(&qs, NULL, (unsigned char*) argv[optind],
+                    strlen(argv[optind]));
+        optind++;
+    }
+
+    if (max_edits_flag) {
+        qs.eds = malloc_or_die(qs.n * sizeof(edit_t*));
+        for (k = 0; k < qs.n; ++k) {
+            qs.eds[k] = fastq_alloc_edit(qs.seqs[k], qs.lens[k]);
+        }
+    }
 
-    sw = fastq_alloc_sw(query, query_len);
+    if (num_threads < 1) num_threads = 1;
+    fastq_set_inflate_threads((int) num_threads);
+    workspaces = malloc_or_die(num_threads * sizeof(match_workspace_t));
+    for (i = 0; i < num_threads; ++i) {
+        workspaces[i].sws = NULL;
+        if (!max_edits_flag) {
+            workspaces[i].sws = malloc_or_die(qs.n * sizeof(sw_t*));
+            for (k = 0; k < qs.n; ++k) {
+                workspaces[i].sws[k] = fastq_alloc_sw(qs.seqs[k], qs.lens[k]);
+            }
+        }
+        workspaces[i].size = 0;
+        workspaces[i].seq = NULL;
+    }
 
     if (optind >= argc || (argc - optind == 1 && strcmp(argv[optind],"-") == 0)) {
-        fastq_match(stdin, stdout, sw);
+        fastq_match(stdin, stdout, &qs, workspaces, num_threads);
     }
     else {
         for (; optind < argc; optind++) {
@@ -139,11 +523,32 @@ int main(int argc, char* argv[])
                 continue;
             }
 
-            fastq_match(fin, stdout, sw);
+            fastq_match(fin, stdout, &qs, workspaces, num_threads);
         }
     }
 
-    fastq_free_sw(sw);
+    for (i = 0; i < num_threads; ++i) {
+        if (workspaces[i].sws) {
+            for (k = 0; k < qs.n; ++k) fastq_free_sw(workspaces[i].sws[k]);
+            free(workspaces[i].sws);
+        }
+        free(workspaces[i].seq);
+    }
+    free(workspaces);
+
+    if (queries_fn) {
+        for (k = 0; k < qs.n; ++k) {
+            free(qs.seqs[k]);
+            free(qs.names[k]);
+        }
+    }
+    if (qs.eds) {
+        for (k = 0; k < qs.n; ++k) fastq_free_edit(qs.eds[k]);
+        free(qs.eds);
+    }
+    free(qs.seqs);
+    free(qs.lens);
+    free(qs.names);
 
     return 0;
 }
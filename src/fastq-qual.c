@@ -42,25 +42,29 @@ void print_help()
 
 void tally_quals(FILE* fin, unsigned int** xs, size_t* n)
 {
-    seq_t* seq = seq_create();
+    fastq_batch_t* batch = fastq_batch_create();
     fastq_t* fqf = fastq_create(fin);
+    seq_t* seq;
 
-    size_t i;
+    size_t i, j;
 
-    while (fastq_read(fqf, seq)) {
-        if (seq->qual.n > *n) {
-            *xs = realloc_or_die(*xs, 255 * seq->qual.n * sizeof(unsigned int));
-            memset(*xs + *n, 0, 255 * (seq->qual.n - *n) * sizeof(unsigned int));
-            *n  = seq->qual.n;
-        }
+    while (fastq_read_batch(fqf, batch)) {
+        for (j = 0; j < batch->n; ++j) {
+            seq = &batch->seqs[j];
+            if (seq->qual.n > *n) {
+                *xs = realloc_or_die(*xs, 255 * seq->qual.n * sizeof(unsigned int));
+                memset(*xs + *n, 0, 255 * (seq->qual.n - *n) * sizeof(unsigned int));
+                *n  = seq->qual.n;
+            }
 
 
-        for (i = 0; i < seq->qual.n; ++i) {
-            (*xs)[i * 255 + (int) seq->qual.s[i]] += 1;
+            for (i = 0; i < seq->qual.n; ++i) {
+                (*xs)[i * 255 + (int) seq->qual.s[i]] += 1;
+            }
         }
     }
 
-    seq_free(seq);
+    fastq_batch_free(batch);
     fastq_free(fqf);
 }
 
@@ -11,10 +11,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <zlib.h>
 
 #include "common.h"
 #include "parse.h"
@@ -30,12 +32,47 @@ int rev_cmp(const void* a, const void* b)
 }
 
 
+/* Sort keys: a fixed-width key, ordered as the comparison function orders
+ * entries, is computed for each entry as it is read, so that entries can be
+ * radix sorted by key, the comparison function being needed only to order
+ * entries of equal key, and not even then if keys are exact. Without a key
+ * function, entries are sorted by comparison alone. */
+static uint64_t (*key_fn)(const seq_t*);
+static bool key_exact;
+
+/* Entries of equal key may be keyed again, by the key of the next eight bytes
+ * of a string, when the first such key is key_fn and equal keys mean equal
+ * bytes. Returns the key at the given depth, along with whether the string
+ * goes on past it. */
+static uint64_t (*key_refine_fn)(const seq_t*, size_t depth, bool* more);
+
+/* Keys are complemented to sort in reverse. */
+static uint64_t key_flip;
+
+typedef struct
+{
+    uint64_t key;
+    size_t idx;
+} seq_key_t;
+
+
+/* Number of threads to sort with. */
+static size_t num_threads = 1;
+
+/* zlib compression level of temporary files, or 0 to leave them
+ * uncompressed. */
+static int compress_level = 0;
+
+
 /* A collection of filenames of sorted chunks of fastq. */
 typedef struct seq_dumps_t_
 {
     char** fns;
     size_t n;
     size_t size;
+
+    /* Chunks are added and taken away by background threads. */
+    pthread_mutex_t lock;
 } seq_dumps_t;
 
 
@@ -45,25 +82,277 @@ seq_dumps_t* seq_dumps_create()
     d->n = 0;
     d->size = 64;
     d->fns = malloc_or_die(d->size * sizeof(char*));
+    pthread_mutex_init(&d->lock, NULL);
     return d;
 }
 
 
-void seq_dumps_free(seq_dumps_t* d)
+void seq_dumps_push(seq_dumps_t* d, char* fn)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->n == d->size) {
+        d->size *= 2;
+        d->fns = realloc_or_die(d->fns, d->size * sizeof(char*));
+    }
+    d->fns[d->n++] = fn;
+    pthread_mutex_unlock(&d->lock);
+}
+
+
+/* Take away the n oldest chunks, returning their filenames. */
+char** seq_dumps_take(seq_dumps_t* d, size_t n)
+{
+    char** fns = malloc_or_die(n * sizeof(char*));
+    pthread_mutex_lock(&d->lock);
+    memcpy(fns, d->fns, n * sizeof(char*));
+    memmove(d->fns, d->fns + n, (d->n - n) * sizeof(char*));
+    d->n -= n;
+    pthread_mutex_unlock(&d->lock);
+    return fns;
+}
+
+
+/* Remove temporary files and free their names. */
+void remove_dumps(char** fns, size_t n)
 {
     size_t i;
-    for (i = 0; i < d->n; ++i) {
-        if (unlink(d->fns[i]) == -1) {
+    for (i = 0; i < n; ++i) {
+        if (unlink(fns[i]) == -1) {
             fprintf(stderr, "Warning: unable to remove temporary file %s.\n",
-                    d->fns[i]);
+                    fns[i]);
         }
-        free(d->fns[i]);
+        free(fns[i]);
     }
+}
+
+
+void seq_dumps_free(seq_dumps_t* d)
+{
+    remove_dumps(d->fns, d->n);
+    pthread_mutex_destroy(&d->lock);
     free(d->fns);
     free(d);
 }
 
 
+/* Sorted chunks are dumped as binary records: the sort key, if there is a key
+ * function, then the lengths of the four strings of an entry, as 32-bit
+ * integers, followed by the strings themselves, each null-terminated. */
+typedef struct
+{
+    uint32_t id1, seq, id2, qual;
+} seq_record_lens_t;
+
+
+/* Size of the output buffer of a chunk being dumped. */
+#define DUMP_BUF_SIZE 0x100000
+
+
+/* Create a temporary file to dump a chunk to, setting fn to its name. */
+static gzFile dump_open(const char* tmpdir, char** fn)
+{
+    const char* template = "/fastq_sort.XXXXXXXX";
+    *fn = malloc_or_die(strlen(template) + strlen(tmpdir) + 1);
+
+    memcpy(*fn, tmpdir, strlen(tmpdir));
+    memcpy(*fn+strlen(tmpdir), template, strlen(template) + 1);
+
+    int fd = mkstemp(*fn);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create a temporary file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* zlib's transparent mode writes uncompressed files. */
+    char mode[16];
+    if (compress_level > 0) snprintf(mode, sizeof(mode), "wb%d", compress_level);
+    else                    strcpy(mode, "wbT");
+
+    gzFile f = gzdopen(fd, mode);
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open temporary file %s for writing.\n", *fn);
+        exit(EXIT_FAILURE);
+    }
+
+    gzbuffer(f, DUMP_BUF_SIZE);
+    return f;
+}
+
+
+/* Write an entry, whose strings must follow one another, as they do both when
+ * pushed to an array and when read from a chunk, so that they are written at
+ * once. */
+static bool dump_write(gzFile f, uint64_t key, const seq_t* seq)
+{
+    seq_record_lens_t lens;
+    size_t len = seq->qual.s + seq->qual.n + 1 - seq->id1.s;
+
+    lens.id1  = seq->id1.n;
+    lens.seq  = seq->seq.n;
+    lens.id2  = seq->id2.n;
+    lens.qual = seq->qual.n;
+
+    if (key_fn && gzwrite(f, &key, sizeof(uint64_t)) <= 0) return false;
+    return gzwrite(f, &lens, sizeof(lens)) > 0 &&
+           gzwrite(f, seq->id1.s, len) == (int) len;
+}
+
+
+/* Finish a dump, adding it to the collection. */
+static void dump_close(seq_dumps_t* d, gzFile f, char* fn, bool ok)
+{
+    if (gzclose(f) != Z_OK) ok = false;
+
+    if (!ok) {
+        fprintf(stderr, "Out of space, unable to write to temporary file: %s\n", fn);
+        fprintf(stderr, "Consider using the --temporary-directory=DIR option to write to a different directory.\n");
+
+        // make sure to delete temporary files
+        unlink(fn);
+        seq_dumps_free(d);
+
+        exit(EXIT_FAILURE);
+    }
+
+    seq_dumps_push(d, fn);
+}
+
+
+/* A sorted chunk being merged, read in large blocks, its current entry pointing
+ * into the block. Chunks are read through zlib, which passes uncompressed
+ * chunks through as they are. */
+typedef struct
+{
+    gzFile f;
+    const char* fn;
+    char* buf;
+    size_t off, n, size;
+    seq_t seq;
+    uint64_t key;
+} seq_run_t;
+
+/* Chunks are merged at most this many at once, with intermediate merges if
+ * there are more. */
+#define MAX_MERGE_FAN_IN 256
+static size_t merge_fan_in = MAX_MERGE_FAN_IN;
+
+/* The smallest block a chunk is read in. */
+#define MIN_RUN_BUF_SIZE 0x10000
+
+
+static void seq_run_open(seq_run_t* r, const char* fn, size_t buf_size)
+{
+    r->fn = fn;
+    r->f = gzopen(fn, "rb");
+    if (r->f == NULL) {
+        fprintf(stderr, "Cannot open temporary file %s for reading.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+
+    /* zlib buffers file input in a fraction of the space */
+    r->size = buf_size < MIN_RUN_BUF_SIZE ? MIN_RUN_BUF_SIZE : buf_size;
+    gzbuffer(r->f, r->size / 8);
+
+    r->buf = malloc_or_die(r->size);
+    r->off = r->n = 0;
+}
+
+
+static void seq_run_close(seq_run_t* r)
+{
+    gzclose(r->f);
+    free(r->buf);
+}
+
+
+/* Return the next len bytes of the chunk, or NULL at its end. */
+static char* seq_run_bytes(seq_run_t* r, size_t len)
+{
+    if (r->n - r->off < len) {
+        memmove(r->buf, r->buf + r->off, r->n - r->off);
+        r->n -= r->off;
+        r->off = 0;
+
+        if (len > r->size) {
+            r->size = len;
+            r->buf = realloc_or_die(r->buf, r->size);
+        }
+
+        int ret = gzread(r->f, r->buf + r->n, r->size - r->n);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot read temporary file %s.\n", r->fn);
+            exit(EXIT_FAILURE);
+        }
+        r->n += ret;
+        if (r->n < len) {
+            if (r->n > 0) {
+                fprintf(stderr, "Temporary file %s is truncated.\n", r->fn);
+                exit(EXIT_FAILURE);
+            }
+            return NULL;
+        }
+    }
+
+    r->off += len;
+    return r->buf + r->off - len;
+}
+
+
+static void set_str(str_t* s, char* data, uint32_t n)
+{
+    s->s = data;
+    s->n = n;
+    s->size = n + 1;
+}
+
+
+/* Read the next entry of a chunk, returning false at its end. */
+static bool seq_run_read(seq_run_t* r)
+{
+    seq_record_lens_t lens;
+    char* data;
+
+    if (key_fn) {
+        if ((data = seq_run_bytes(r, sizeof(uint64_t))) == NULL) return false;
+        memcpy(&r->key, data, sizeof(uint64_t));
+    }
+
+    if ((data = seq_run_bytes(r, sizeof(lens))) == NULL) {
+        if (!key_fn) return false;
+        fprintf(stderr, "Temporary file %s is truncated.\n", r->fn);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&lens, data, sizeof(lens));
+
+    data = seq_run_bytes(r, (size_t) lens.id1 + lens.seq + lens.id2 + lens.qual + 4);
+    if (data == NULL) {
+        fprintf(stderr, "Temporary file %s is truncated.\n", r->fn);
+        exit(EXIT_FAILURE);
+    }
+
+    set_str(&r->seq.id1, data, lens.id1);
+    data += lens.id1 + 1;
+    set_str(&r->seq.seq, data, lens.seq);
+    data += lens.seq + 1;
+    set_str(&r->seq.id2, data, lens.id2);
+    data += lens.id2 + 1;
+    set_str(&r->seq.qual, data, lens.qual);
+
+    return true;
+}
+
+
+/* Order chunks by their current entries, comparing keys first, if any. */
+static int seq_run_cmp(const seq_run_t* a, const seq_run_t* b)
+{
+    if (key_fn) {
+        if (a->key != b->key) return a->key < b->key ? -1 : 1;
+        if (key_exact) return 0;
+    }
+    return cmp(&a->seq, &b->seq);
+}
+
+
 static inline size_t heap_parent(size_t i) { return (i - 1) / 2; }
 static inline size_t heap_left  (size_t i) { return 2 * i + 1; }
 static inline size_t heap_right (size_t i) { return 2 * i + 2; }
@@ -72,16 +361,14 @@ static inline size_t heap_right (size_t i) { return 2 * i + 2; }
 /* Enqueue an item in the heap.
  *
  * Args:
- *   heap: A binary heap in which stores indexs into seqs.
+ *   heap: A binary heap in which stores indexs into runs.
  *   n: Fixed maximum size of the heap.
  *   m: Current size of the heap.
- *   seqs: Sequences.
+ *   runs: Sorted chunks.
  *   idx: Index to enqueue.
- *   cmp: Comparison function.
  *
  */
-void heap_push(size_t* heap, size_t n, size_t* m, seq_t** seqs,
-               int (*cmp)(const void*, const void*), size_t idx)
+void heap_push(size_t* heap, size_t n, size_t* m, seq_run_t* runs, size_t idx)
 {
     if (*m >= n) return;
     size_t tmp, j, i = (*m)++;
@@ -90,7 +377,7 @@ void heap_push(size_t* heap, size_t n, size_t* m, seq_t** seqs,
     /* percolate up */
     while (i > 0) {
         j = heap_parent(i);
-        if (cmp(seqs[heap[i]], seqs[heap[j]]) < 0) {
+        if (seq_run_cmp(&runs[heap[i]], &runs[heap[j]]) < 0) {
             tmp = heap[i];
             heap[i] = heap[j];
             heap[j] = tmp;
@@ -102,8 +389,7 @@ void heap_push(size_t* heap, size_t n, size_t* m, seq_t** seqs,
 
 
 /* Dequeue an item from a heap. */
-size_t heap_pop(size_t* heap, size_t* m, seq_t** seqs,
-               int (*cmp)(const void*, const void*))
+size_t heap_pop(size_t* heap, size_t* m, seq_run_t* runs)
 {
     assert(*m > 0);
     size_t ans = heap[0];
@@ -119,10 +405,10 @@ size_t heap_pop(size_t* heap, size_t* m, seq_t** seqs,
             j = l;
         }
         else {
-            j = cmp(seqs[heap[l]], seqs[heap[r]]) < 0 ? l : r;
+            j = seq_run_cmp(&runs[heap[l]], &runs[heap[r]]) < 0 ? l : r;
         }
 
-        if (cmp(seqs[heap[i]], seqs[heap[j]]) > 0) {
+        if (seq_run_cmp(&runs[heap[i]], &runs[heap[j]]) > 0) {
             tmp = heap[i];
             heap[i] = heap[j];
             heap[j] = tmp;
@@ -135,56 +421,135 @@ size_t heap_pop(size_t* heap, size_t* m, seq_t** seqs,
 }
 
 
-/* n-way merge sort to stdout */
-void merge_sort(const seq_dumps_t* d, int (*cmp)(const void*, const void*))
+/* n-way merge of the given chunks, to fout, or, if fout is NULL, to a new
+ * chunk, splitting buf_size bytes between chunks being read. */
+void merge_dumps(seq_dumps_t* d, char** fns, size_t n, FILE* fout,
+                 size_t buf_size, const char* tmpdir)
 {
-    FILE** files = malloc_or_die(d->n * sizeof(FILE*));
+    seq_run_t* runs = malloc_or_die(n * sizeof(seq_run_t));
     size_t i;
-    for (i = 0; i < d->n; ++i) {
-        files[i] = fopen(d->fns[i], "rb");
-        if (files[i] == NULL) {
-            fprintf(stderr, "Cannot open temporary file %s for reading.\n",
-                    d->fns[i]);
-            exit(EXIT_FAILURE);
-        }
-    }
+    for (i = 0; i < n; ++i) seq_run_open(&runs[i], fns[i], buf_size / n);
 
-    fastq_t** fs = malloc_or_die(d->n * sizeof(fastq_t*));
-    seq_t** seqs = malloc_or_die(d->n * sizeof(seq_t*));
-    for (i = 0; i < d->n; ++i) {
-        fs[i] = fastq_create(files[i]);
-        seqs[i] = seq_create();
-    }
+    gzFile out = NULL;
+    char* out_fn = NULL;
+    bool ok = true;
+    if (fout == NULL) out = dump_open(tmpdir, &out_fn);
 
-    /* A binary heap of indexes to fs. We use this to repeatedly pop the
+    /* A binary heap of indexes to runs. We use this to repeatedly pop the
      * smallest fastq entry. */
-    size_t* heap = malloc_or_die(d->n * sizeof(size_t));
+    size_t* heap = malloc_or_die(n * sizeof(size_t));
 
     /* heap size */
     size_t m = 0;
 
-    for (i = 0; i < d->n; ++i) {
-        if (fastq_read(fs[i], seqs[i])) {
-            heap_push(heap, d->n, &m, seqs, cmp, i);
+    for (i = 0; i < n; ++i) {
+        if (seq_run_read(&runs[i])) {
+            heap_push(heap, n, &m, runs, i);
         }
     }
 
     while (m > 0) {
-        i = heap_pop(heap, &m, seqs, cmp);
-        fastq_print(stdout, seqs[i]);
-        if (fastq_read(fs[i], seqs[i])) {
-            heap_push(heap, d->n, &m, seqs, cmp, i);
+        i = heap_pop(heap, &m, runs);
+        if (out) ok = ok && dump_write(out, runs[i].key, &runs[i].seq);
+        else     fastq_print(fout, &runs[i].seq);
+        if (seq_run_read(&runs[i])) {
+            heap_push(heap, n, &m, runs, i);
         }
     }
 
-    for (i = 0; i < d->n; ++i) {
-        seq_free(seqs[i]);
-        fastq_free(fs[i]);
-        fclose(files[i]);
+    for (i = 0; i < n; ++i) seq_run_close(&runs[i]);
+    if (out) dump_close(d, out, out_fn, ok);
+
+    free(heap);
+    free(runs);
+}
+
+
+/* Merging starts in the background, while input is still being read, once
+ * there are enough chunks, reading them in small blocks, so as to take little
+ * memory from sorting. */
+typedef struct
+{
+    seq_dumps_t* d;
+    char** fns;
+    size_t n;
+    const char* tmpdir;
+} merge_dumps_arg_t;
+
+static merge_dumps_arg_t merge_dumps_arg;
+static pthread_t merger;
+static bool merging = false;
+static bool merge_done;
+
+
+static void* merge_dumps_thread(void* arg_)
+{
+    merge_dumps_arg_t* arg = arg_;
+    merge_dumps(arg->d, arg->fns, arg->n, NULL, arg->n * MIN_RUN_BUF_SIZE,
+                arg->tmpdir);
+    remove_dumps(arg->fns, arg->n);
+    free(arg->fns);
+
+    pthread_mutex_lock(&arg->d->lock);
+    merge_done = true;
+    pthread_mutex_unlock(&arg->d->lock);
+    return NULL;
+}
+
+
+/* Wait for any chunks being merged in the background. */
+void merge_wait()
+{
+    if (merging) {
+        pthread_join(merger, NULL);
+        merging = false;
+    }
+}
+
+
+/* Start merging chunks in the background, if there are enough of them, and no
+ * merge already under way. */
+void merge_background(seq_dumps_t* d, const char* tmpdir)
+{
+    bool ready;
+
+    pthread_mutex_lock(&d->lock);
+    ready = (!merging || merge_done) && d->n >= merge_fan_in;
+    pthread_mutex_unlock(&d->lock);
+    if (!ready) return;
+
+    merge_wait();
+    merge_dumps_arg.d = d;
+    merge_dumps_arg.n = merge_fan_in;
+    merge_dumps_arg.fns = seq_dumps_take(d, merge_fan_in);
+    merge_dumps_arg.tmpdir = tmpdir;
+    merge_done = false;
+    if (pthread_create(&merger, NULL, merge_dumps_thread, &merge_dumps_arg) != 0) {
+        fprintf(stderr, "Unable to create a thread.\n");
+        exit(EXIT_FAILURE);
     }
+    merging = true;
+}
+
+
+/* Merge every chunk to stdout, first merging as few as needed into new chunks
+ * so that no more than the fan-in remain. */
+void merge_sort(seq_dumps_t* d, size_t buf_size, const char* tmpdir)
+{
+    size_t n;
+    char** fns;
 
-    free(files);
-    free(fs);
+    merge_wait();
+
+    while (d->n > merge_fan_in) {
+        n = (d->n - 2) % (merge_fan_in - 1) + 2;
+        fns = seq_dumps_take(d, n);
+        merge_dumps(d, fns, n, NULL, buf_size, tmpdir);
+        remove_dumps(fns, n);
+        free(fns);
+    }
+
+    merge_dumps(d, d->fns, d->n, stdout, buf_size, tmpdir);
 }
 
 
@@ -206,6 +571,16 @@ typedef struct seq_array_t_
 
     /* Total data size. */
     size_t data_size;
+
+    /* Space to merge or permute into when sorting. */
+    seq_t* tmp;
+    size_t tmp_size;
+
+    /* Sort key of each entry, if there is a key function, and space to radix
+     * sort them. */
+    seq_key_t* keys;
+    seq_key_t* keys_tmp;
+    size_t keys_tmp_size;
 } seq_array_t;
 
 
@@ -220,6 +595,13 @@ seq_array_t* seq_array_create(size_t data_size)
     a->data_used = 0;
     a->data = malloc_or_die(data_size);
 
+    a->tmp = NULL;
+    a->tmp_size = 0;
+
+    a->keys = key_fn ? malloc_or_die(a->size * sizeof(seq_key_t)) : NULL;
+    a->keys_tmp = NULL;
+    a->keys_tmp_size = 0;
+
     return a;
 }
 
@@ -228,6 +610,9 @@ void seq_array_free(seq_array_t* a)
 {
     free(a->seqs);
     free(a->data);
+    free(a->tmp);
+    free(a->keys);
+    free(a->keys_tmp);
     free(a);
 }
 
@@ -244,6 +629,7 @@ bool seq_array_push(seq_array_t* a, const seq_t* seq)
     if (a->n == a->size) {
         a->size *= 2;
         a->seqs = realloc_or_die(a->seqs, a->size * sizeof(seq_t));
+        if (key_fn) a->keys = realloc_or_die(a->keys, a->size * sizeof(seq_key_t));
     }
 
     memcpy(&a->data[a->data_used], seq->id1.s, seq->id1.n + 1);
@@ -266,6 +652,11 @@ bool seq_array_push(seq_array_t* a, const seq_t* seq)
     a->seqs[a->n].qual.n = seq->qual.n;
     a->data_used += seq->qual.n + 1;
 
+    if (key_fn) {
+        a->keys[a->n].key = key_fn(&a->seqs[a->n]) ^ key_flip;
+        a->keys[a->n].idx = a->n;
+    }
+
     ++a->n;
 
     return true;
@@ -279,9 +670,289 @@ void seq_array_clear(seq_array_t* a)
 }
 
 
+/* Sorting in parallel is by merge sort: an array is split in two, each half
+ * sorted, one in a new thread, and the halves merged. Merges are themselves
+ * split in two about the middle item of the larger half, each part merged by
+ * its own thread. Below this many items, an array is just sorted with qsort,
+ * or merged by one thread. */
+#define PARALLEL_SORT_MIN 10000
+
+typedef struct
+{
+    seq_t* xs;
+    seq_t* tmp;
+    size_t n;
+    size_t num_threads;
+    int (*cmp)(const void*, const void*);
+} sort_arg_t;
+
+
+typedef struct
+{
+    const seq_t* as;
+    size_t na;
+    const seq_t* bs;
+    size_t nb;
+    seq_t* out;
+    size_t num_threads;
+    int (*cmp)(const void*, const void*);
+} merge_arg_t;
+
+
+/* Run f(x) in a new thread, and g(y) in this one, returning once both have. */
+static void fork_join(void* (*f)(void*), void* x, void* (*g)(void*), void* y)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, f, x) != 0) {
+        fprintf(stderr, "Unable to create a thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    g(y);
+    pthread_join(thread, NULL);
+}
+
+
+/* Merge two sorted arrays, preferring the first of equal items. */
+static void* merge_thread(void* arg_)
+{
+    merge_arg_t* arg = arg_;
+    const seq_t* as = arg->as;
+    const seq_t* bs = arg->bs;
+    size_t na = arg->na, nb = arg->nb;
+    seq_t* out = arg->out;
+    size_t i, j, lo, hi, mid;
+
+    if (arg->num_threads < 2 || na + nb < PARALLEL_SORT_MIN) {
+        i = j = 0;
+        while (i < na && j < nb) {
+            if (arg->cmp(&bs[j], &as[i]) < 0) *out++ = bs[j++];
+            else                              *out++ = as[i++];
+        }
+        memcpy(out, as + i, (na - i) * sizeof(seq_t));
+        memcpy(out + (na - i), bs + j, (nb - j) * sizeof(seq_t));
+        return NULL;
+    }
+
+    merge_arg_t left = *arg, right = *arg;
+    left.num_threads = arg->num_threads / 2;
+    right.num_threads = arg->num_threads - left.num_threads;
+
+    /* Split about a middle item, which goes after items of the other array
+     * that are less than it, if it is from the first array, or no greater,
+     * if from the second. */
+    lo = 0;
+    if (na >= nb) {
+        i = na / 2;
+        hi = nb;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (arg->cmp(&bs[mid], &as[i]) < 0) lo = mid + 1;
+            else                                hi = mid;
+        }
+        j = lo;
+        out[i + j] = as[i];
+        right.as = as + i + 1;
+        right.bs = bs + j;
+    }
+    else {
+        j = nb / 2;
+        hi = na;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (arg->cmp(&bs[j], &as[mid]) < 0) hi = mid;
+            else                                lo = mid + 1;
+        }
+        i = lo;
+        out[i + j] = bs[j];
+        right.as = as + i;
+        right.bs = bs + j + 1;
+    }
+
+    left.na = i;
+    left.nb = j;
+    right.na = na - (right.as - as);
+    right.nb = nb - (right.bs - bs);
+    right.out = out + i + j + 1;
+
+    fork_join(merge_thread, &left, merge_thread, &right);
+    return NULL;
+}
+
+
+static void* sort_thread(void* arg_)
+{
+    sort_arg_t* arg = arg_;
+
+    if (arg->num_threads < 2 || arg->n < PARALLEL_SORT_MIN) {
+        qsort(arg->xs, arg->n, sizeof(seq_t), arg->cmp);
+        return NULL;
+    }
+
+    sort_arg_t left = *arg, right = *arg;
+    left.n = arg->n / 2;
+    left.num_threads = arg->num_threads / 2;
+    right.xs = arg->xs + left.n;
+    right.tmp = arg->tmp + left.n;
+    right.n = arg->n - left.n;
+    right.num_threads = arg->num_threads - left.num_threads;
+
+    fork_join(sort_thread, &left, sort_thread, &right);
+
+    merge_arg_t m;
+    m.as = left.xs;
+    m.na = left.n;
+    m.bs = right.xs;
+    m.nb = right.n;
+    m.out = arg->tmp;
+    m.num_threads = arg->num_threads;
+    m.cmp = arg->cmp;
+    merge_thread(&m);
+
+    memcpy(arg->xs, arg->tmp, arg->n * sizeof(seq_t));
+    return NULL;
+}
+
+
+/* Sort keys by least significant digit radix sort, a byte at a time, skipping
+ * bytes that are the same in every key, and returning whichever of xs and tmp
+ * the keys end up in. */
+static seq_key_t* radix_sort_keys(seq_key_t* xs, seq_key_t* tmp, size_t n)
+{
+    size_t counts[8][256];
+    size_t i, total, c;
+    seq_key_t* t;
+    int b;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; ++i) {
+        for (b = 0; b < 8; ++b) counts[b][(xs[i].key >> (8 * b)) & 0xff]++;
+    }
+
+    for (b = 0; b < 8 && n > 0; ++b) {
+        if (counts[b][(xs[0].key >> (8 * b)) & 0xff] == n) continue;
+
+        for (total = 0, i = 0; i < 256; ++i) {
+            c = counts[b][i];
+            counts[b][i] = total;
+            total += c;
+        }
+
+        for (i = 0; i < n; ++i) {
+            tmp[counts[b][(xs[i].key >> (8 * b)) & 0xff]++] = xs[i];
+        }
+
+        t = xs;
+        xs = tmp;
+        tmp = t;
+    }
+
+    return xs;
+}
+
+
+/* Sort runs of equal keys by the keys of the following bytes, most
+ * significant first, until the strings end. Keys in ks are left as they
+ * were, and tmp is space for as many. */
+static void refine_keys(const seq_array_t* a, seq_key_t* ks, seq_key_t* tmp,
+                        size_t n, size_t depth)
+{
+    size_t i, j, k;
+    uint64_t key;
+    bool more, any_more;
+    seq_key_t* sorted;
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && ks[j].key == ks[i].key; ++j);
+        if (j - i < 2) continue;
+
+        key = ks[i].key;
+        any_more = false;
+        for (k = i; k < j; ++k) {
+            ks[k].key = key_refine_fn(&a->seqs[ks[k].idx], depth + 1, &more) ^ key_flip;
+            any_more = any_more || more;
+        }
+
+        sorted = radix_sort_keys(ks + i, tmp + i, j - i);
+        if (sorted != ks + i) memcpy(ks + i, sorted, (j - i) * sizeof(seq_key_t));
+        if (any_more) refine_keys(a, ks + i, tmp + i, j - i, depth + 1);
+
+        for (k = i; k < j; ++k) ks[k].key = key;
+    }
+}
+
+
+/* Sort an array of entries with as many threads as there are to sort with. */
+static void sort_seqs(seq_t* xs, seq_t* tmp, size_t n,
+                      int (*cmp)(const void*, const void*))
+{
+    sort_arg_t arg;
+    arg.xs = xs;
+    arg.tmp = tmp;
+    arg.n = n;
+    arg.num_threads = num_threads;
+    arg.cmp = cmp;
+    sort_thread(&arg);
+}
+
+
+/* Sort by key, and then by comparison among entries of equal key, unless
+ * equal keys can be refined until they mean equal entries. Runs of equal key
+ * are sorted in parallel, so keys that fail to tell entries apart cost no more
+ * than sorting by comparison alone. */
+static void seq_array_sort_keys(seq_array_t* a, int (*cmp)(const void*, const void*))
+{
+    size_t i, j;
+    seq_key_t* ks;
+    seq_key_t* tmp;
+
+    if (a->tmp_size < a->n) {
+        a->tmp_size = a->size;
+        a->tmp = realloc_or_die(a->tmp, a->tmp_size * sizeof(seq_t));
+    }
+
+    if (a->keys_tmp_size < a->size) {
+        a->keys_tmp_size = a->size;
+        a->keys_tmp = realloc_or_die(a->keys_tmp, a->keys_tmp_size * sizeof(seq_key_t));
+    }
+
+    ks = radix_sort_keys(a->keys, a->keys_tmp, a->n);
+    tmp = ks == a->keys ? a->keys_tmp : a->keys;
+    if (key_refine_fn) refine_keys(a, ks, tmp, a->n, 0);
+
+    /* keep sorted keys, to be dumped along with entries */
+    a->keys_tmp = tmp;
+    a->keys = ks;
+
+    for (i = 0; i < a->n; ++i) a->tmp[i] = a->seqs[ks[i].idx];
+    memcpy(a->seqs, a->tmp, a->n * sizeof(seq_t));
+
+    if (key_exact || key_refine_fn) return;
+
+    for (i = 0; i < a->n; i = j) {
+        for (j = i + 1; j < a->n && ks[j].key == ks[i].key; ++j);
+        if (j - i > 1) sort_seqs(a->seqs + i, a->tmp + i, j - i, cmp);
+    }
+}
+
+
 void seq_array_sort(seq_array_t* a, int (*cmp)(const void*, const void*))
 {
-    qsort(a->seqs, a->n, sizeof(seq_t), cmp);
+    if (key_fn) {
+        seq_array_sort_keys(a, cmp);
+        return;
+    }
+
+    if (num_threads < 2 || a->n < PARALLEL_SORT_MIN) {
+        qsort(a->seqs, a->n, sizeof(seq_t), cmp);
+        return;
+    }
+
+    if (a->tmp_size < a->n) {
+        a->tmp_size = a->size;
+        a->tmp = realloc_or_die(a->tmp, a->tmp_size * sizeof(seq_t));
+    }
+
+    sort_seqs(a->seqs, a->tmp, a->n, cmp);
 }
 
 
@@ -387,49 +1058,196 @@ int seq_cmp_mean_qual(const void* a, const void* b)
 }
 
 
-void seq_array_dump(seq_dumps_t* d, const seq_array_t* a, const char* tmpdir)
+/* Up to eight bytes of a string, from the given offset, as a big-endian
+ * number, so that keys are ordered as strcmp orders strings, up to ties. */
+static uint64_t str_key(const str_t* s, size_t off)
 {
-    const char* template = "/fastq_sort.XXXXXXXX";
-    char* fn = malloc_or_die(strlen(template) + strlen(tmpdir) + 1);
+    uint64_t key = 0;
+    size_t i;
+    for (i = off; i < off + 8; ++i) {
+        key = (key << 8) | (i < s->n ? (unsigned char) s->s[i] : 0);
+    }
+    return key;
+}
 
-    memcpy(fn, tmpdir, strlen(tmpdir));
-    memcpy(fn+strlen(tmpdir), template, strlen(template) + 1);
 
-    int fd = mkstemp(fn);
-    if (fd == -1) {
-        fprintf(stderr, "Unable to create a temporary file.\n");
-        exit(EXIT_FAILURE);
-    }
+uint64_t seq_key_id(const seq_t* s)
+{
+    return str_key(&s->id1, 0);
+}
 
-    FILE* f = fdopen(fd, "w");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open temporary file %s for writing.\n", fn);
-        exit(EXIT_FAILURE);
+
+/* Identifiers sharing a long prefix, as run accessions do, are told apart by
+ * the eight bytes at each depth in turn. */
+uint64_t seq_key_id_at(const seq_t* s, size_t depth, bool* more)
+{
+    *more = s->id1.n > 8 * (depth + 1);
+    return str_key(&s->id1, 8 * depth);
+}
+
+
+/* Nucleotide sequences are keyed more compactly, by up to their first 21
+ * characters at three bits each. So that keys are still ordered as strcmp
+ * orders sequences, each code stands for a range of characters, ending with
+ * one of A, C, G, N, or T, and the key ends after any other character, which
+ * is then left to the comparison function. */
+#define SEQ_KEY_LEN 21
+
+static inline int seq_key_code(unsigned char c)
+{
+    if      (c == '\0') return 0;
+    else if (c <= 'A')  return 1;
+    else if (c <= 'C')  return 2;
+    else if (c <= 'G')  return 3;
+    else if (c <= 'N')  return 4;
+    else if (c <= 'T')  return 5;
+    else                return 6;
+}
+
+
+uint64_t seq_key_seq(const seq_t* s)
+{
+    uint64_t key = 0;
+    size_t i, n = s->seq.n < SEQ_KEY_LEN ? s->seq.n : SEQ_KEY_LEN;
+    unsigned char c;
+
+    for (i = 0; i < n; ++i) {
+        c = (unsigned char) s->seq.s[i];
+        key = (key << 3) | seq_key_code(c);
+        if (c != 'A' && c != 'C' && c != 'G' && c != 'N' && c != 'T') {
+            ++i;
+            break;
+        }
     }
 
+    return key << (3 * (SEQ_KEY_LEN - i));
+}
+
+
+uint64_t seq_key_hash(const seq_t* s)
+{
+    return seq_hash(s);
+}
+
+
+/* Non-negative floats are ordered as their bits are. */
+static uint64_t float_key(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+
+uint64_t seq_key_gc(const seq_t* s)
+{
+    return float_key(seq_gc(s));
+}
+
+
+uint64_t seq_key_mean_qual(const seq_t* s)
+{
+    return float_key(seq_mean_qual(s));
+}
+
+
+void seq_array_dump(seq_dumps_t* d, const seq_array_t* a, const char* tmpdir)
+{
+    char* fn;
+    gzFile f = dump_open(tmpdir, &fn);
+
     size_t i;
-    for (i = 0; i < a->n; ++i) {
-        int ret = fastq_print(f, &a->seqs[i]);
-        if (ret <= 0) {
-            fprintf(stderr, "Out of space, unable to write to temporary file: %s\n", fn);
-            fprintf(stderr, "Consider using the --temporary-directory=DIR option to write to a different directory.\n");
+    bool ok = true;
+    for (i = 0; i < a->n && ok; ++i) {
+        ok = dump_write(f, key_fn ? a->keys[i].key : 0, &a->seqs[i]);
+    }
 
-            // make sure to delete temporary files
-            fclose(f);
-            unlink(fn);
-            seq_dumps_free(d);
+    dump_close(d, f, fn, ok);
+}
 
-            exit(EXIT_FAILURE);
-        }
+
+/* When sorting in parallel, a full array is sorted and dumped in the
+ * background while a spare one is filled. */
+typedef struct
+{
+    seq_dumps_t* d;
+    seq_array_t* a;
+    const char* tmpdir;
+} spill_arg_t;
+
+static seq_array_t* spare;
+static spill_arg_t spill_arg;
+static pthread_t spill;
+static bool spilling = false;
+
+
+static void* spill_thread(void* arg_)
+{
+    spill_arg_t* arg = arg_;
+    seq_array_sort(arg->a, cmp);
+    seq_array_dump(arg->d, arg->a, arg->tmpdir);
+    return NULL;
+}
+
+
+/* Wait for any array being dumped in the background. */
+void spill_wait()
+{
+    if (spilling) {
+        pthread_join(spill, NULL);
+        spilling = false;
     }
+}
 
-    if (d->n == d->size) {
-        d->size *= 2;
-        d->fns = realloc_or_die(d->fns, d->size * sizeof(char*));
+
+/* Sort and dump a full array, leaving an empty one to fill. */
+void seq_array_spill(seq_dumps_t* d, seq_array_t** a, const char* tmpdir)
+{
+    merge_background(d, tmpdir);
+
+    if (spare == NULL) {
+        seq_array_sort(*a, cmp);
+        seq_array_dump(d, *a, tmpdir);
+        seq_array_clear(*a);
+        return;
     }
-    d->fns[d->n++] = fn;
 
-    fclose(f);
+    spill_wait();
+    spill_arg.d = d;
+    spill_arg.a = *a;
+    spill_arg.tmpdir = tmpdir;
+    if (pthread_create(&spill, NULL, spill_thread, &spill_arg) != 0) {
+        fprintf(stderr, "Unable to create a thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    spilling = true;
+
+    seq_array_t* full = *a;
+    *a = spare;
+    spare = full;
+    seq_array_clear(*a);
+}
+
+
+/* Read every entry from f into a, sorting and dumping a to a temporary file
+ * whenever it fills up. */
+void sort_input(fastq_t* f, fastq_batch_t* batch, seq_array_t** a,
+                seq_dumps_t* d, const char* tmpdir)
+{
+    size_t i;
+    seq_t* seq;
+    while (fastq_read_batch(f, batch)) {
+        for (i = 0; i < batch->n; ++i) {
+            seq = &batch->seqs[i];
+            if (!seq_array_push(*a, seq)) {
+                seq_array_spill(d, a, tmpdir);
+                if (!seq_array_push(*a, seq)) {
+                    fprintf(stderr, "The buffer size is to small.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
 }
 
 
@@ -452,6 +1270,10 @@ void print_help()
 "  -M, --mean-qual    sort by median quality score\n"
 "  -S, --buffer-size=SIZE         amount of memory to use for sorting\n"
 "  -T, --temporary-directory=DIR  write temporary files here, instead of $TMPDIR, or /tmp\n"
+"      --compress[=LEVEL]         compress temporary files with zlib, at the given\n"
+"                                 level, from 1 (fastest) to 9 (default: 1)\n"
+"  -p, --parallel=N   sort using N threads, dividing the buffer in two, so that\n"
+"                     one half is filled while the other is sorted (default: 1)\n"
 "  -h, --help         print this message\n"
 "  -V, --version      output version information and exit\n"
    );
@@ -478,6 +1300,8 @@ int main(int argc, char* argv[])
     size_t buffer_size = 1000000000;
     bool reverse_sort = false;
     user_cmp = seq_cmp_id;
+    key_fn = seq_key_id;
+    key_refine_fn = seq_key_id_at;
 
     char const *tmpdir = getenv("TMPDIR");
     if (tmpdir == NULL)
@@ -493,15 +1317,17 @@ int main(int argc, char* argv[])
         {"seq",         no_argument,       NULL, 's'},
         {"random",      no_argument,       NULL, 'R'},
         {"seed",        optional_argument, NULL, 0},
+        {"compress",    optional_argument, NULL, 0},
         {"gc",          no_argument,       NULL, 'G'},
         {"mean-qual",   no_argument,       NULL, 'M'},
+        {"parallel",    required_argument, NULL, 'p'},
         {"help",        no_argument,       NULL, 'h'},
         {"version",     no_argument,       NULL, 'V'},
         {0, 0, 0, 0}
     };
 
     while (true) {
-        opt = getopt_long(argc, argv, "S:rinsRGhV", long_options, &opt_idx);
+        opt = getopt_long(argc, argv, "S:T:p:rinsRGMhV", long_options, &opt_idx);
         if (opt == -1) break;
 
         switch (opt) {
@@ -519,26 +1345,43 @@ int main(int argc, char* argv[])
 
             case 'i':
                 user_cmp = seq_cmp_id;
+                key_fn = seq_key_id;
+                key_refine_fn = seq_key_id_at;
                 break;
 
             case 'n':
                 user_cmp = seq_cmp_id_num;
+                key_fn = NULL;
+                key_refine_fn = NULL;
                 break;
 
             case 's':
                 user_cmp = seq_cmp_seq;
+                key_fn = seq_key_seq;
+                key_refine_fn = NULL;
                 break;
 
             case 'R':
                 user_cmp = seq_cmp_hash;
+                key_fn = seq_key_hash;
+                key_refine_fn = NULL;
                 break;
 
             case 'G':
                 user_cmp = seq_cmp_gc;
+                key_fn = seq_key_gc;
+                key_refine_fn = NULL;
                 break;
 
             case 'M':
                 user_cmp = seq_cmp_mean_qual;
+                key_fn = seq_key_mean_qual;
+                key_refine_fn = NULL;
+                break;
+
+            case 'p':
+                num_threads = (size_t) strtoul(optarg, NULL, 10);
+                if (num_threads < 1) num_threads = 1;
                 break;
 
             case 'h':
@@ -560,6 +1403,13 @@ int main(int argc, char* argv[])
                     }
                     seq_hash_set_seed(seed);
                 }
+                else if (strcmp(long_options[opt_idx].name, "compress") == 0) {
+                    compress_level = optarg ? atoi(optarg) : 1;
+                    if (compress_level < 1 || compress_level > 9) {
+                        fprintf(stderr, "Compression level must be from 1 to 9.\n");
+                        return EXIT_FAILURE;
+                    }
+                }
                 break;
 
             case '?':
@@ -571,25 +1421,40 @@ int main(int argc, char* argv[])
     }
 
     cmp = reverse_sort ? rev_cmp : user_cmp;
+    fastq_set_inflate_threads((int) num_threads);
+    key_exact = user_cmp == seq_cmp_hash || user_cmp == seq_cmp_gc ||
+                user_cmp == seq_cmp_mean_qual;
+    key_flip = reverse_sort ? ~(uint64_t) 0 : 0;
+
+    /* Merge no more chunks at once than there is memory to read them in
+     * blocks of at least the minimum size, or than there are file
+     * descriptors. */
+    long max_files = sysconf(_SC_OPEN_MAX);
+    if (max_files > 0 && (size_t) max_files / 2 < merge_fan_in) {
+        merge_fan_in = (size_t) max_files / 2;
+    }
+    if (buffer_size / MIN_RUN_BUF_SIZE < merge_fan_in) {
+        merge_fan_in = buffer_size / MIN_RUN_BUF_SIZE;
+    }
+    if (merge_fan_in < 2) merge_fan_in = 2;
+
+    seq_array_t* a;
+    if (num_threads > 1) {
+        a = seq_array_create(buffer_size / 2);
+        spare = seq_array_create(buffer_size / 2);
+    }
+    else {
+        a = seq_array_create(buffer_size);
+        spare = NULL;
+    }
 
-    seq_array_t* a = seq_array_create(buffer_size);
     seq_dumps_t* d = seq_dumps_create();
-    seq_t* seq = seq_create();
+    fastq_batch_t* batch = fastq_batch_create();
 
     fastq_t* f;
     if (optind >= argc) {
         f = fastq_create(stdin);
-        while (fastq_read(f, seq)) {
-            if (!seq_array_push(a, seq)) {
-                seq_array_sort(a, cmp);
-                seq_array_dump(d, a, tmpdir);
-                seq_array_clear(a);
-                if (!seq_array_push(a, seq)) {
-                    fprintf(stderr, "The buffer size is to small.\n");
-                    return EXIT_FAILURE;
-                }
-            }
-        }
+        sort_input(f, batch, &a, d, tmpdir);
         fastq_free(f);
     }
     else {
@@ -601,24 +1466,15 @@ int main(int argc, char* argv[])
                 return EXIT_FAILURE;
             }
             f = fastq_create(file);
-
-            while (fastq_read(f, seq)) {
-                if (!seq_array_push(a, seq)) {
-                    seq_array_sort(a, cmp);
-                    seq_array_dump(d, a, tmpdir);
-                    seq_array_clear(a);
-                    if (!seq_array_push(a, seq)) {
-                        fprintf(stderr, "The buffer size is to small.\n");
-                        return EXIT_FAILURE;
-                    }
-                }
-            }
-
+            sort_input(f, batch, &a, d, tmpdir);
             fastq_free(f);
             fclose(file);
         }
     }
 
+    spill_wait();
+    merge_wait();
+
     if (a->n > 0) {
         seq_array_sort(a, cmp);
 
@@ -631,13 +1487,20 @@ int main(int argc, char* argv[])
         }
         else {
             seq_array_dump(d, a, tmpdir);
-            merge_sort(d, cmp);
+
+            /* memory for sorting is now free to merge with */
+            seq_array_free(a);
+            if (spare) seq_array_free(spare);
+            a = spare = NULL;
+
+            merge_sort(d, buffer_size, tmpdir);
         }
     }
 
     seq_dumps_free(d);
-    seq_free(seq);
-    seq_array_free(a);
+    fastq_batch_free(batch);
+    if (a) seq_array_free(a);
+    if (spare) seq_array_free(spare);
 
     return EXIT_SUCCESS;
 }
@@ -50,18 +50,23 @@ static size_t total_reads;
 void fastq_hash(FILE* fin, hash_table* T)
 {
     fastq_t* fqf = fastq_create(fin);
-    seq_t* seq = seq_create();
+    fastq_batch_t* batch = fastq_batch_create();
+    seq_t* seq;
+    size_t i;
 
-    while (fastq_read(fqf, seq)) {
-        inc_hash_table(T, seq->seq.s, seq->seq.n);
+    while (fastq_read_batch(fqf, batch)) {
+        for (i = 0; i < batch->n; ++i) {
+            seq = &batch->seqs[i];
+            inc_hash_table(T, seq->seq.s, seq->seq.n);
 
-        total_reads++;
-        if (verbose_flag && total_reads % 100000 == 0) {
-            fprintf(stderr, "%zu reads processed ...\n", total_reads);
+            total_reads++;
+            if (verbose_flag && total_reads % 100000 == 0) {
+                fprintf(stderr, "%zu reads processed ...\n", total_reads);
+            }
         }
     }
 
-    seq_free(seq);
+    fastq_batch_free(batch);
     fastq_free(fqf);
 }
 
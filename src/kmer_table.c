@@ -0,0 +1,116 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * Items are kept inline in a single array and found by linear probing, so that
+ * a lookup usually touches just one cache line.
+ *
+ */
+
+
+#include "kmer_table.h"
+#include "common.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+
+static const size_t INITIAL_TABLE_SIZE = 1024;
+static const double MAX_LOAD = 0.7;
+
+
+/* Fibonacci hashing, taking the top log2(n) bits of the product, n being a
+ * power of two. */
+static inline size_t kmer_hash(uint64_t kmer, size_t n)
+{
+    return (size_t) ((kmer * UINT64_C(0x9e3779b97f4a7c15)) >>
+                     (64 - __builtin_ctzll((unsigned long long) n)));
+}
+
+
+kmer_table* create_kmer_table()
+{
+    kmer_table* T = malloc_or_die(sizeof(kmer_table));
+    T->A = malloc_or_die(INITIAL_TABLE_SIZE * sizeof(kmer_count));
+    memset(T->A, 0, INITIAL_TABLE_SIZE * sizeof(kmer_count));
+    T->n = INITIAL_TABLE_SIZE;
+    T->m = 0;
+    T->max_m = T->n * MAX_LOAD;
+
+    return T;
+}
+
+
+void destroy_kmer_table(kmer_table* T)
+{
+    if (T != NULL) {
+        free(T->A);
+        free(T);
+    }
+}
+
+
+static void rehash(kmer_table* T, size_t new_n)
+{
+    kmer_count* A = malloc_or_die(new_n * sizeof(kmer_count));
+    memset(A, 0, new_n * sizeof(kmer_count));
+
+    size_t i, h;
+    for (i = 0; i < T->n; i++) {
+        if (T->A[i].count == 0) continue;
+        h = kmer_hash(T->A[i].kmer, new_n);
+        while (A[h].count != 0) h = (h + 1) & (new_n - 1);
+        A[h] = T->A[i];
+    }
+
+    free(T->A);
+    T->A = A;
+    T->n = new_n;
+    T->max_m = new_n * MAX_LOAD;
+}
+
+
+void add_kmer_table(kmer_table* T, uint64_t kmer, uint32_t count)
+{
+    size_t h = kmer_hash(kmer, T->n);
+
+    while (T->A[h].count != 0) {
+        if (T->A[h].kmer == kmer) {
+            T->A[h].count += count;
+            return;
+        }
+        h = (h + 1) & (T->n - 1);
+    }
+
+    if (T->m >= T->max_m) {
+        rehash(T, T->n * 2);
+        add_kmer_table(T, kmer, count);
+        return;
+    }
+
+    T->A[h].kmer  = kmer;
+    T->A[h].count = count;
+    T->m++;
+}
+
+
+static int kmer_count_cmp(const void* a_, const void* b_)
+{
+    const kmer_count* a = a_;
+    const kmer_count* b = b_;
+    return a->kmer < b->kmer ? -1 : a->kmer > b->kmer;
+}
+
+
+size_t sort_kmer_table(kmer_table* T)
+{
+    size_t i, j;
+    for (i = 0, j = 0; i < T->n; i++) {
+        if (T->A[i].count != 0) T->A[j++] = T->A[i];
+    }
+
+    qsort(T->A, j, sizeof(kmer_count), kmer_count_cmp);
+    return j;
+}
+
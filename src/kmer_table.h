@@ -0,0 +1,52 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * kmer_table :
+ * Counting of packed k-mers, for k too large to count every possible one.
+ *
+ */
+
+
+#ifndef FASTQ_TOOLS_KMER_TABLE_H
+#define FASTQ_TOOLS_KMER_TABLE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+typedef struct
+{
+    uint64_t kmer;
+    uint32_t count; /* 0 for an empty slot */
+} kmer_count;
+
+
+typedef struct
+{
+    kmer_count* A; /* table proper */
+    size_t n;      /* table size, a power of two */
+    size_t m;      /* hashed items */
+    size_t max_m;  /* max hashed items before rehash */
+} kmer_table;
+
+
+kmer_table* create_kmer_table();
+
+void destroy_kmer_table(kmer_table*);
+
+void add_kmer_table(kmer_table*, uint64_t kmer, uint32_t count);
+
+static inline void inc_kmer_table(kmer_table* T, uint64_t kmer)
+{
+    add_kmer_table(T, kmer, 1);
+}
+
+/* Move every item to the front of the table, in increasing order of k-mer,
+ * returning their number. The table must not be added to afterwards. */
+size_t sort_kmer_table(kmer_table*);
+
+
+#endif
+
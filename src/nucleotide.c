@@ -0,0 +1,93 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ */
+
+#include "nucleotide.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static const unsigned char nt_codes[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+ /*    A     C           G                                  */
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+ /*             T                                           */
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+ /*    a     c           g                                  */
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+ /*             t                                           */
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4 };
+
+
+/* Folding a character to lower case with c | 0x20, the low four bits of 'a',
+ * 'c', 'g', and 't' are 1, 3, 7, and 4. So with SSSE3, one shuffle looks up
+ * the code for sixteen characters at once by those bits, and another the
+ * letter that must have been seen for that code to apply. With only SSE2,
+ * each letter is compared against in turn. */
+void fastq_nt_encode(unsigned char* out, const char* s_, size_t n)
+{
+    const unsigned char* s = (const unsigned char*) s_;
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    const __m128i codes = _mm_setr_epi8(4, 0, 4, 1, 3, 4, 4, 2,
+                                        4, 4, 4, 4, 4, 4, 4, 4);
+    const __m128i letters = _mm_setr_epi8(0, 'a', 0, 'c', 't', 0, 0, 'g',
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i unknown = _mm_set1_epi8(4);
+    __m128i c, nibble, seen, r;
+
+    for (; i + 16 <= n; i += 16) {
+        c = _mm_or_si128(_mm_loadu_si128((const __m128i*) (s + i)), fold);
+        nibble = _mm_and_si128(c, low);
+        seen = _mm_cmpeq_epi8(c, _mm_shuffle_epi8(letters, nibble));
+        r = _mm_and_si128(seen, _mm_shuffle_epi8(codes, nibble));
+        r = _mm_or_si128(r, _mm_andnot_si128(seen, unknown));
+        _mm_storeu_si128((__m128i*) (out + i), r);
+    }
+#elif defined(__SSE2__)
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i a = _mm_set1_epi8('a'), cc = _mm_set1_epi8('c');
+    const __m128i g = _mm_set1_epi8('g'), t = _mm_set1_epi8('t');
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    const __m128i three = _mm_set1_epi8(3), unknown = _mm_set1_epi8(4);
+    __m128i c, ma, mc, mg, mt, r;
+
+    for (; i + 16 <= n; i += 16) {
+        c = _mm_or_si128(_mm_loadu_si128((const __m128i*) (s + i)), fold);
+        ma = _mm_cmpeq_epi8(c, a);
+        mc = _mm_cmpeq_epi8(c, cc);
+        mg = _mm_cmpeq_epi8(c, g);
+        mt = _mm_cmpeq_epi8(c, t);
+        r = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(ma, mc),
+                                          _mm_or_si128(mg, mt)), unknown);
+        r = _mm_or_si128(r, _mm_and_si128(mc, one));
+        r = _mm_or_si128(r, _mm_and_si128(mg, two));
+        r = _mm_or_si128(r, _mm_and_si128(mt, three));
+        _mm_storeu_si128((__m128i*) (out + i), r);
+    }
+#endif
+
+    for (; i < n; ++i) out[i] = nt_codes[s[i]];
+}
+
@@ -0,0 +1,26 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * nucleotide :
+ * Conversion of nucleotide sequences to small integer codes.
+ *
+ */
+
+#ifndef FASTQ_TOOLS_NUCLEOTIDE_H
+#define FASTQ_TOOLS_NUCLEOTIDE_H
+
+#include <stdlib.h>
+
+/* Code given to anything other than A, C, G, or T. */
+#define FASTQ_NT_N 4
+
+/* Encode n ASCII nucleotides as 0, 1, 2, 3 for A, C, G, T, in either case,
+ * and FASTQ_NT_N for anything else, U included. The low two bits are thus
+ * the packed nucleotide, and the third bit marks unknown ones. out may be the
+ * same as s. */
+void fastq_nt_encode(unsigned char* out, const char* s, size_t n);
+
+#endif
+
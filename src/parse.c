@@ -1,7 +1,10 @@
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "parse.h"
 #include "common.h"
@@ -179,30 +182,462 @@ uint32_t seq_hash(const seq_t* seq)
 static const size_t parser_buf_size = 1000000;
 
 
+/* Maximum size of a BGZF block, compressed or not. */
+static const size_t bgzf_max_block_size = 0x10000;
+
+
+/* Number of threads used to inflate BGZF input. */
+static int inflate_threads = 1;
+
+
+void fastq_set_inflate_threads(int n)
+{
+    inflate_threads = n;
+}
+
+
+/* A chunk of inflated input. */
+typedef struct
+{
+    char* out;
+    size_t len;
+
+    /* Compressed BGZF blocks, yet to be inflated. */
+    unsigned char* in;
+    size_t in_len;
+
+    /* Set once out has been filled. */
+    bool ready;
+} gz_chunk_t;
+
+
+/* Gzip input, inflated by separate threads into a ring of chunks, so that
+ * decompression overlaps with parsing.
+ *
+ * A plain gzip stream can only be inflated sequentially, so it gets a single
+ * thread. BGZF input is a series of independently compressed blocks, so each
+ * of several threads claims the next chunk, reads the blocks for it, in order,
+ * and then inflates them in parallel with the others.
+ */
+typedef struct gz_reader_t_
+{
+    FILE* file;
+    bool bgzf;
+
+    /* Input already read while detecting the format. */
+    unsigned char* pre;
+    size_t pre_len, pre_pos;
+
+    /* Stream state, for plain gzip. */
+    z_stream strm;
+    unsigned char* in;
+
+    gz_chunk_t* chunks;
+    size_t num_chunks;
+
+    /* Number of chunks claimed by producers and released by the consumer. */
+    size_t head, tail;
+
+    /* Position within the chunk being consumed. */
+    size_t pos;
+
+    /* Set when the last chunk has been claimed. */
+    bool eof;
+
+    /* Set to ask the producers to quit early. */
+    bool stop;
+
+    pthread_t* threads;
+    size_t num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} gz_reader_t;
+
+
+/* Read up to n bytes of compressed input. */
+static size_t gz_read_raw(gz_reader_t* gz, unsigned char* out, size_t n)
+{
+    size_t k = gz->pre_len - gz->pre_pos;
+    if (k > 0) {
+        if (k > n) k = n;
+        memcpy(out, gz->pre + gz->pre_pos, k);
+        gz->pre_pos += k;
+        return k;
+    }
+    return fread(out, 1, n, gz->file);
+}
+
+
+/* Inflate as much as fits in out, returning the number of bytes written and
+ * setting *finished if there is no more input. Concatenated gzip members are
+ * read as one stream. */
+static size_t gz_inflate(gz_reader_t* gz, char* out, size_t n, bool* finished)
+{
+    z_stream* strm = &gz->strm;
+    strm->next_out  = (unsigned char*) out;
+    strm->avail_out = n;
+    *finished = false;
+
+    int ret;
+    while (strm->avail_out > 0) {
+        if (strm->avail_in == 0) {
+            strm->next_in  = gz->in;
+            strm->avail_in = gz_read_raw(gz, gz->in, parser_buf_size);
+            if (strm->avail_in == 0) {
+                fprintf(stderr, "Warning: gzip input is truncated.\n");
+                *finished = true;
+                break;
+            }
+        }
+
+        ret = inflate(strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            if (strm->avail_in == 0) {
+                strm->next_in  = gz->in;
+                strm->avail_in = gz_read_raw(gz, gz->in, parser_buf_size);
+            }
+
+            /* Anything other than another member is trailing garbage. */
+            if (strm->avail_in == 0 || strm->next_in[0] != 0x1f) {
+                *finished = true;
+                break;
+            }
+
+            inflateReset(strm);
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Malformed gzip input: %s\n",
+                    strm->msg ? strm->msg : "unknown error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return n - strm->avail_out;
+}
+
+
+/* True if the gzip member beginning at p, of length n, is a BGZF block. */
+static bool is_bgzf(const unsigned char* p, size_t n)
+{
+    return n >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+           (p[3] & 4) && p[12] == 'B' && p[13] == 'C' &&
+           p[14] == 2 && p[15] == 0;
+}
+
+
+static inline uint32_t read_le32(const unsigned char* p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+           ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+/* Read as many whole BGZF blocks into c->in as are sure to fit in c->out once
+ * inflated, setting *finished at the end of input. */
+static void bgzf_read_blocks(gz_reader_t* gz, gz_chunk_t* c, bool* finished)
+{
+    size_t bsize, k, i;
+    unsigned char* p;
+
+    c->in_len = 0;
+    *finished = false;
+    for (i = 0; i < parser_buf_size / bgzf_max_block_size; ++i) {
+        p = c->in + c->in_len;
+        k = gz_read_raw(gz, p, 18);
+        if (k < 18) k += gz_read_raw(gz, p + k, 18 - k);
+        if (k == 0) {
+            *finished = true;
+            break;
+        }
+
+        if (!is_bgzf(p, k)) {
+            fprintf(stderr, "Malformed BGZF input.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        bsize = ((size_t) p[16] | ((size_t) p[17] << 8)) + 1;
+        if (bsize < 26) {
+            fprintf(stderr, "Malformed BGZF input.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        k = 18;
+        while (k < bsize) {
+            size_t r = gz_read_raw(gz, p + k, bsize - k);
+            if (r == 0) {
+                fprintf(stderr, "Warning: BGZF input is truncated.\n");
+                *finished = true;
+                return;
+            }
+            k += r;
+        }
+
+        c->in_len += bsize;
+    }
+}
+
+
+/* Inflate the BGZF blocks in c->in into c->out. */
+static void bgzf_inflate_blocks(z_stream* strm, gz_chunk_t* c)
+{
+    unsigned char* p = c->in;
+    unsigned char* end = c->in + c->in_len;
+    size_t bsize, isize;
+
+    c->len = 0;
+    while (p < end) {
+        bsize = ((size_t) p[16] | ((size_t) p[17] << 8)) + 1;
+        isize = read_le32(p + bsize - 4);
+
+        inflateReset(strm);
+        strm->next_in   = p + 18;
+        strm->avail_in  = bsize - 26;
+        strm->next_out  = (unsigned char*) c->out + c->len;
+        strm->avail_out = isize;
+
+        if (isize > bgzf_max_block_size ||
+            inflate(strm, Z_FINISH) != Z_STREAM_END || strm->avail_out != 0 ||
+            crc32(crc32(0, NULL, 0), (unsigned char*) c->out + c->len, isize) !=
+                read_le32(p + bsize - 8)) {
+            fprintf(stderr, "Malformed BGZF input.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        c->len += isize;
+        p += bsize;
+    }
+}
+
+
+static void* gz_reader_thread(void* arg)
+{
+    gz_reader_t* gz = arg;
+    gz_chunk_t* c;
+    bool finished;
+
+    z_stream strm;
+    if (gz->bgzf) {
+        memset(&strm, 0, sizeof(z_stream));
+        if (inflateInit2(&strm, -15) != Z_OK) {
+            fprintf(stderr, "Unable to initialize zlib.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&gz->mutex);
+    while (true) {
+        while (gz->head - gz->tail == gz->num_chunks && !gz->eof && !gz->stop) {
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        }
+        if (gz->eof || gz->stop) break;
+
+        /* The consumer does not touch this chunk until it is ready. */
+        c = &gz->chunks[gz->head++ % gz->num_chunks];
+
+        if (gz->bgzf) {
+            /* Blocks are read while holding the lock, so that chunks are
+             * claimed and filled in order, but inflated without it. */
+            bgzf_read_blocks(gz, c, &finished);
+            gz->eof = finished;
+            pthread_mutex_unlock(&gz->mutex);
+            bgzf_inflate_blocks(&strm, c);
+        }
+        else {
+            pthread_mutex_unlock(&gz->mutex);
+            c->len = gz_inflate(gz, c->out, parser_buf_size, &finished);
+        }
+
+        pthread_mutex_lock(&gz->mutex);
+        if (finished) gz->eof = true;
+        c->ready = true;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+
+    if (gz->bgzf) inflateEnd(&strm);
+
+    return NULL;
+}
+
+
+/* Begin inflating, with the first n bytes of file already read into pre. */
+static gz_reader_t* gz_reader_create(FILE* file, const char* pre, size_t n)
+{
+    gz_reader_t* gz = malloc_or_die(sizeof(gz_reader_t));
+    gz->file = file;
+    gz->bgzf = is_bgzf((const unsigned char*) pre, n);
+
+    gz->pre = malloc_or_die(n);
+    memcpy(gz->pre, pre, n);
+    gz->pre_len = n;
+    gz->pre_pos = 0;
+
+    size_t i;
+    if (gz->bgzf) {
+        gz->num_threads = inflate_threads;
+        if (gz->num_threads < 1) {
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            gz->num_threads = ncpus > 0 ? (size_t) ncpus : 1;
+        }
+        gz->num_chunks = 2 * gz->num_threads;
+        if (gz->num_chunks < 4) gz->num_chunks = 4;
+        gz->in = NULL;
+    }
+    else {
+        gz->num_threads = 1;
+        gz->num_chunks = 4;
+        gz->in = malloc_or_die(parser_buf_size);
+        memset(&gz->strm, 0, sizeof(z_stream));
+
+        /* 15 bits of window, plus 16 to expect a gzip header. */
+        if (inflateInit2(&gz->strm, 15 + 16) != Z_OK) {
+            fprintf(stderr, "Unable to initialize zlib.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    gz->chunks = malloc_or_die(gz->num_chunks * sizeof(gz_chunk_t));
+    for (i = 0; i < gz->num_chunks; ++i) {
+        gz->chunks[i].out = malloc_or_die(parser_buf_size);
+        gz->chunks[i].in  = gz->bgzf ? malloc_or_die(parser_buf_size) : NULL;
+        gz->chunks[i].len = 0;
+        gz->chunks[i].ready = false;
+    }
+
+    gz->head = gz->tail = gz->pos = 0;
+    gz->eof = gz->stop = false;
+    pthread_mutex_init(&gz->mutex, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+
+    gz->threads = malloc_or_die(gz->num_threads * sizeof(pthread_t));
+    for (i = 0; i < gz->num_threads; ++i) {
+        if (pthread_create(&gz->threads[i], NULL, gz_reader_thread, gz) != 0) {
+            fprintf(stderr, "Unable to create a thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return gz;
+}
+
+
+static void gz_reader_free(gz_reader_t* gz)
+{
+    pthread_mutex_lock(&gz->mutex);
+    gz->stop = true;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+
+    size_t i;
+    for (i = 0; i < gz->num_threads; ++i) {
+        pthread_join(gz->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&gz->mutex);
+    pthread_cond_destroy(&gz->cond);
+    if (!gz->bgzf) inflateEnd(&gz->strm);
+
+    for (i = 0; i < gz->num_chunks; ++i) {
+        free(gz->chunks[i].out);
+        free(gz->chunks[i].in);
+    }
+    free(gz->chunks);
+    free(gz->threads);
+    free(gz->in);
+    free(gz->pre);
+    free(gz);
+}
+
+
+/* Copy up to n inflated bytes into out, returning fewer only at the end of the
+ * stream. */
+static size_t gz_reader_read(gz_reader_t* gz, char* out, size_t n)
+{
+    size_t len = 0, k;
+    gz_chunk_t* c;
+    bool ready;
+    while (len < n) {
+        pthread_mutex_lock(&gz->mutex);
+        c = &gz->chunks[gz->tail % gz->num_chunks];
+        while (!c->ready && !(gz->eof && gz->head == gz->tail)) {
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        }
+        ready = c->ready;
+        pthread_mutex_unlock(&gz->mutex);
+        if (!ready) break;
+
+        k = c->len - gz->pos;
+        if (k > n - len) k = n - len;
+        memcpy(out + len, c->out + gz->pos, k);
+        len += k;
+        gz->pos += k;
+
+        if (gz->pos == c->len) {
+            gz->pos = 0;
+            pthread_mutex_lock(&gz->mutex);
+            c->ready = false;
+            ++gz->tail;
+            pthread_cond_broadcast(&gz->cond);
+            pthread_mutex_unlock(&gz->mutex);
+        }
+    }
+
+    return len;
+}
+
+
 struct fastq_t_
 {
     FILE* file;
+    gz_reader_t* gz;
     size_t readlen;
+    size_t size;
     char* buf;
     char* next;
     bool linestart;
 };
 
 
+/* Read up to n bytes of input, returning fewer only at end-of-file. */
+static size_t fastq_fill(fastq_t* f, char* out, size_t n)
+{
+    if (f->gz) return gz_reader_read(f->gz, out, n);
+    else       return fread(out, 1, n, f->file);
+}
+
+
+/* Read the first block of input, deciding from it whether the input is gzipped
+ * or not. */
+static void fastq_open(fastq_t* f)
+{
+    f->readlen = fread(f->buf, 1, parser_buf_size, f->file);
+    f->next = f->buf;
+    f->linestart = true;
+
+    if (f->readlen >= 2 && (unsigned char) f->buf[0] == 0x1f &&
+                           (unsigned char) f->buf[1] == 0x8b) {
+        f->gz = gz_reader_create(f->file, f->buf, f->readlen);
+        f->readlen = 0;
+    }
+    else f->gz = NULL;
+}
+
 
 fastq_t* fastq_create(FILE* file)
 {
     fastq_t* f = malloc_or_die(sizeof(fastq_t));
     f->file = file;
-    f->next = f->buf = malloc_or_die(parser_buf_size);
-    f->readlen = 0;
-    f->linestart = true;
+    f->size = parser_buf_size;
+    f->buf = malloc_or_die(f->size);
+    fastq_open(f);
     return f;
 }
 
 
 void fastq_free(fastq_t* f)
 {
+    if (f->gz) gz_reader_free(f->gz);
     free(f->buf);
     free(f);
 }
@@ -267,7 +702,7 @@ bool fastq_read(fastq_t* f, seq_t* seq)
         }
 
         /* Try to read more. */
-        f->readlen = fread(f->buf, 1, parser_buf_size, f->file);
+        f->readlen = fastq_fill(f, f->buf, f->size);
         f->next = f->buf;
         end = f->buf + f->readlen;
     } while (f->readlen);
@@ -276,11 +711,130 @@ bool fastq_read(fastq_t* f, seq_t* seq)
 }
 
 
-void fastq_rewind(fastq_t* f)
+fastq_batch_t* fastq_batch_create()
 {
-    rewind(f->file);
+    fastq_batch_t* b = malloc_or_die(sizeof(fastq_batch_t));
+    b->n = 0;
+    b->size = 1024;
+    b->seqs = malloc_or_die(b->size * sizeof(seq_t));
+    b->data_size = parser_buf_size;
+    b->data = malloc_or_die(b->data_size);
+    return b;
+}
+
+
+void fastq_batch_free(fastq_batch_t* b)
+{
+    free(b->seqs);
+    free(b->data);
+    free(b);
+}
+
+
+/* Point str at the line from s to u, terminating it. */
+static void str_view(str_t* str, char* s, char* u)
+{
+    *u = '\0';
+    str->s = s;
+    str->n = u - s;
+    str->size = 0;
+}
+
+
+/* Parse as many complete entries as possible from b->data[0, len), returning
+ * the number of bytes consumed. */
+static size_t fastq_parse_batch(fastq_batch_t* b, size_t len)
+{
+    char* end = b->data + len;
+    char* next = b->data;
+    char *id1, *seq, *id2, *qual;
+    char *u1, *u2, *u3, *u4;
+    seq_t* s;
+
+    while (next < end) {
+        /* Find all four lines before touching any, so an incomplete entry is
+         * left intact to be carried over. */
+        id1 = next[0] == '@' ? next + 1 : next;
+        if ((u1 = memchr(id1, '\n', end - id1)) == NULL) break;
+
+        seq = u1 + 1;
+        if ((u2 = memchr(seq, '\n', end - seq)) == NULL) break;
+
+        id2 = u2 + 1;
+        if (id2 < end && id2[0] == '+') ++id2;
+        if ((u3 = memchr(id2, '\n', end - id2)) == NULL) break;
+
+        qual = u3 + 1;
+        if ((u4 = memchr(qual, '\n', end - qual)) == NULL) break;
+
+        if (b->n == b->size) {
+            b->size *= 2;
+            b->seqs = realloc_or_die(b->seqs, b->size * sizeof(seq_t));
+        }
+        s = &b->seqs[b->n++];
+
+        str_view(&s->id1,  id1,  u1);
+        str_view(&s->seq,  seq,  u2);
+        str_view(&s->id2,  id2,  u3);
+        str_view(&s->qual, qual, u4);
+
+        next = u4 + 1;
+    }
+
+    return next - b->data;
+}
+
+
+size_t fastq_read_batch(fastq_t* f, fastq_batch_t* b)
+{
+    b->n = 0;
+
+    /* Begin with whatever is left over from the last read. */
+    size_t len = f->buf + f->readlen - f->next;
+    if (len > b->data_size) {
+        b->data_size = len;
+        b->data = realloc_or_die(b->data, b->data_size);
+    }
+    memcpy(b->data, f->next, len);
     f->next = f->buf;
     f->readlen = 0;
+    f->linestart = true;
+
+    size_t consumed;
+    bool eof = false;
+    while (true) {
+        len += fastq_fill(f, b->data + len, b->data_size - len);
+        eof = len < b->data_size;
+
+        consumed = fastq_parse_batch(b, len);
+        if (b->n > 0 || eof) break;
+
+        /* Not even one entry fits, so the buffer must grow. */
+        b->data_size *= 2;
+        b->data = realloc_or_die(b->data, b->data_size);
+    }
+
+    /* Carry over the incomplete tail. At end-of-file it is simply discarded,
+     * as it would be by fastq_read. */
+    if (!eof) {
+        f->readlen = len - consumed;
+        if (f->readlen > f->size) {
+            f->size = f->readlen;
+            f->buf = realloc_or_die(f->buf, f->size);
+        }
+        memcpy(f->buf, b->data + consumed, f->readlen);
+        f->next = f->buf;
+    }
+
+    return b->n;
+}
+
+
+void fastq_rewind(fastq_t* f)
+{
+    if (f->gz) gz_reader_free(f->gz);
+    rewind(f->file);
+    fastq_open(f);
 }
 
 
@@ -63,6 +63,11 @@ typedef struct fastq_t_ fastq_t;
 fastq_t* fastq_create(FILE* file);
 
 
+/* Set the number of threads used to decompress BGZF input, one by default.
+ * If n is less than 1, one thread per processor is used. */
+void fastq_set_inflate_threads(int n);
+
+
 /* Free memory associated with a fastq_t object. */
 void fastq_free(fastq_t*);
 
@@ -86,6 +91,48 @@ bool fastq_read(fastq_t* f, seq_t* seq);
 void fastq_rewind(fastq_t* f);
 
 
+/* A batch of fastq entries parsed in place.
+ *
+ * The strings of each entry in seqs point directly into data, which the batch
+ * owns, rather than being copied. They are null-terminated, but have size 0,
+ * since they can not be grown, and are valid only until the batch is read into
+ * again or freed.
+ */
+typedef struct
+{
+    seq_t* seqs;      /* parsed entries */
+    size_t n;         /* number of entries */
+    size_t size;      /* entries allocated in seqs */
+
+    char* data;       /* raw input */
+    size_t data_size; /* bytes allocated for data */
+} fastq_batch_t;
+
+
+/* Allocate a new empty batch. */
+fastq_batch_t* fastq_batch_create();
+
+
+/* Free a batch allocated with fastq_batch_create. */
+void fastq_batch_free(fastq_batch_t* b);
+
+
+/* Read as many complete fastq entries as fit in the batch's buffer.
+ *
+ * An entry left incomplete at the end of the buffer is carried over to the next
+ * call. Reads may be freely interleaved with fastq_read on the same parser.
+ *
+ * Args:
+ *   f: A fastq_t parser object.
+ *   b: A batch allocated with fastq_batch_create, whose previous contents are
+ *      discarded.
+ *
+ * Returns:
+ *   The number of entries read, which is 0 only when end-of-file was reached.
+ */
+size_t fastq_read_batch(fastq_t* f, fastq_batch_t* b);
+
+
 /* Print a fastq entry. */
 int fastq_print(FILE* fout, const seq_t* seq);
 
@@ -0,0 +1,211 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pipeline.h"
+#include "common.h"
+
+
+typedef struct
+{
+    fastq_batch_t* batch;
+    void* result;
+    bool done;
+} pipeline_slot_t;
+
+
+/* Shared state. Slots are used as a ring, where every slot before head has been
+ * read, every slot before next has been claimed by a worker, and every slot
+ * before tail has been emitted. */
+typedef struct
+{
+    const pipeline_t* p;
+    fastq_t* f;
+
+    pipeline_slot_t* slots;
+    size_t num_slots;
+    size_t head, next, tail;
+
+    /* Set when the reader has read its last batch. */
+    bool eof;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} pipeline_state_t;
+
+
+typedef struct
+{
+    pipeline_state_t* s;
+    void* workspace;
+} pipeline_worker_t;
+
+
+static void* pipeline_reader_thread(void* arg)
+{
+    pipeline_state_t* s = arg;
+    pipeline_slot_t* slot;
+    size_t n;
+
+    while (true) {
+        pthread_mutex_lock(&s->mutex);
+        while (s->head - s->tail == s->num_slots) {
+            pthread_cond_wait(&s->cond, &s->mutex);
+        }
+        pthread_mutex_unlock(&s->mutex);
+
+        /* No one else touches this slot until head moves past it. */
+        slot = &s->slots[s->head % s->num_slots];
+        n = fastq_read_batch(s->f, slot->batch);
+
+        pthread_mutex_lock(&s->mutex);
+        if (n == 0) s->eof = true;
+        else {
+            slot->done = false;
+            ++s->head;
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+
+        if (n == 0) break;
+    }
+
+    return NULL;
+}
+
+
+static void* pipeline_worker_thread(void* arg)
+{
+    pipeline_worker_t* w = arg;
+    pipeline_state_t* s = w->s;
+    pipeline_slot_t* slot;
+
+    pthread_mutex_lock(&s->mutex);
+    while (true) {
+        while (s->next == s->head && !s->eof) {
+            pthread_cond_wait(&s->cond, &s->mutex);
+        }
+        if (s->next == s->head) break;
+
+        slot = &s->slots[s->next++ % s->num_slots];
+        pthread_mutex_unlock(&s->mutex);
+
+        s->p->work(slot->batch, slot->result, w->workspace, s->p->ctx);
+
+        pthread_mutex_lock(&s->mutex);
+        slot->done = true;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+
+static void pipeline_serial(fastq_t* f, const pipeline_t* p)
+{
+    fastq_batch_t* batch = fastq_batch_create();
+    void* result = p->result_create ? p->result_create(p->ctx) : NULL;
+    void* workspace = p->workspaces ? p->workspaces[0] : NULL;
+
+    while (fastq_read_batch(f, batch)) {
+        p->work(batch, result, workspace, p->ctx);
+        if (p->emit) p->emit(batch, result, p->ctx);
+    }
+
+    if (p->result_free) p->result_free(result, p->ctx);
+    fastq_batch_free(batch);
+}
+
+
+void fastq_pipeline(fastq_t* f, const pipeline_t* p)
+{
+    if (p->num_threads < 2) {
+        pipeline_serial(f, p);
+        return;
+    }
+
+    pipeline_state_t s;
+    s.p = p;
+    s.f = f;
+    s.num_slots = 2 * p->num_threads;
+    s.slots = malloc_or_die(s.num_slots * sizeof(pipeline_slot_t));
+    s.head = s.next = s.tail = 0;
+    s.eof = false;
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    size_t i;
+    for (i = 0; i < s.num_slots; ++i) {
+        s.slots[i].batch = fastq_batch_create();
+        s.slots[i].result = p->result_create ? p->result_create(p->ctx) : NULL;
+        s.slots[i].done = false;
+    }
+
+    pthread_t reader;
+    pthread_t* threads = malloc_or_die(p->num_threads * sizeof(pthread_t));
+    pipeline_worker_t* workers =
+        malloc_or_die(p->num_threads * sizeof(pipeline_worker_t));
+
+    if (pthread_create(&reader, NULL, pipeline_reader_thread, &s) != 0) {
+        fprintf(stderr, "Unable to create a thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < p->num_threads; ++i) {
+        workers[i].s = &s;
+        workers[i].workspace = p->workspaces ? p->workspaces[i] : NULL;
+        if (pthread_create(&threads[i], NULL, pipeline_worker_thread,
+                           &workers[i]) != 0) {
+            fprintf(stderr, "Unable to create a thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Emit batches in order as they are finished. */
+    pipeline_slot_t* slot;
+    bool finished;
+    while (true) {
+        pthread_mutex_lock(&s.mutex);
+        slot = &s.slots[s.tail % s.num_slots];
+        while (!(s.tail < s.next && slot->done) && !(s.eof && s.tail == s.head)) {
+            pthread_cond_wait(&s.cond, &s.mutex);
+        }
+        finished = s.tail == s.head;
+        pthread_mutex_unlock(&s.mutex);
+
+        if (finished) break;
+
+        if (p->emit) p->emit(slot->batch, slot->result, p->ctx);
+
+        pthread_mutex_lock(&s.mutex);
+        ++s.tail;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.mutex);
+    }
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < p->num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < s.num_slots; ++i) {
+        fastq_batch_free(s.slots[i].batch);
+        if (p->result_free) p->result_free(s.slots[i].result, p->ctx);
+    }
+
+    pthread_mutex_destroy(&s.mutex);
+    pthread_cond_destroy(&s.cond);
+    free(workers);
+    free(threads);
+    free(s.slots);
+}
+
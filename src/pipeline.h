@@ -0,0 +1,56 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * pipeline :
+ * Process batches of fastq entries in parallel, keeping their order.
+ *
+ */
+
+#ifndef FASTQ_TOOLS_PIPELINE_H
+#define FASTQ_TOOLS_PIPELINE_H
+
+#include <stddef.h>
+
+#include "parse.h"
+
+
+typedef struct
+{
+    /* Number of worker threads. With fewer than 2, everything is done in the
+     * calling thread, one batch at a time. */
+    size_t num_threads;
+
+    /* Process a batch, in some worker thread, writing any results to result.
+     * The batch may be modified. */
+    void (*work)(fastq_batch_t* batch, void* result, void* workspace,
+                 void* ctx);
+
+    /* Consume a processed batch and its results in the calling thread. Batches
+     * are emitted in the order they were read. May be NULL. */
+    void (*emit)(fastq_batch_t* batch, void* result, void* ctx);
+
+    /* Allocate and free storage for the results of one batch. Storage is
+     * reused from batch to batch. May be NULL. */
+    void* (*result_create)(void* ctx);
+    void  (*result_free)(void* result, void* ctx);
+
+    /* One workspace per worker thread, passed to work, or NULL. */
+    void** workspaces;
+
+    /* Passed to every function above. */
+    void* ctx;
+} pipeline_t;
+
+
+/* Read every entry from f, processing them as directed by p.
+ *
+ * A reader thread parses batches, which are handed to the worker threads, and
+ * then emitted in order by the calling thread.
+ */
+void fastq_pipeline(fastq_t* f, const pipeline_t* p);
+
+
+#endif
+
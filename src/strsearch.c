@@ -0,0 +1,143 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * Candidate positions are found by comparing a block of the haystack against
+ * the first character of the needle, and the block k - 1 characters further on
+ * against the last, so that most of the haystack is rejected with a few vector
+ * instructions per block, and only the remaining candidates are compared in
+ * full. This is done 32 bytes at a time with AVX2 or 16 at a time with SSE2,
+ * when the compiler targets either, and one byte at a time otherwise.
+ *
+ * Case is ignored by setting the 0x20 bit of every character compared against
+ * a letter of the needle, which folds exactly the upper and lower case forms of
+ * that letter together and nothing else.
+ *
+ */
+
+#include "strsearch.h"
+#include "common.h"
+#include <ctype.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+struct strsearch_t_
+{
+    /* needle, with each letter in lower case */
+    unsigned char* needle;
+
+    /* 0x20 for each letter of the needle, 0 for anything else */
+    unsigned char* fold;
+
+    size_t n;
+};
+
+
+strsearch_t* fastq_alloc_strsearch(const char* needle, size_t n)
+{
+    strsearch_t* ss = malloc_or_die(sizeof(strsearch_t));
+    ss->needle = malloc_or_die(n);
+    ss->fold   = malloc_or_die(n);
+    ss->n      = n;
+
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        ss->fold[i]   = isalpha((unsigned char) needle[i]) ? 0x20 : 0;
+        ss->needle[i] = (unsigned char) needle[i] | ss->fold[i];
+    }
+
+    return ss;
+}
+
+
+void fastq_free_strsearch(strsearch_t* ss)
+{
+    free(ss->needle);
+    free(ss->fold);
+    free(ss);
+}
+
+
+/* True if the needle occurs at s. */
+static inline bool strsearch_at(const strsearch_t* ss, const unsigned char* s)
+{
+    size_t j;
+    for (j = 0; j < ss->n; ++j) {
+        if ((s[j] | ss->fold[j]) != ss->needle[j]) return false;
+    }
+    return true;
+}
+
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/* Check every candidate position i + j, for each bit j set in mask. */
+static inline bool strsearch_candidates(const strsearch_t* ss,
+                                        const unsigned char* s, size_t i,
+                                        unsigned int mask)
+{
+    while (mask) {
+        if (strsearch_at(ss, s + i + __builtin_ctz(mask))) return true;
+        mask &= mask - 1;
+    }
+    return false;
+}
+#endif
+
+
+bool fastq_strsearch(const strsearch_t* ss, const char* s_, size_t n)
+{
+    const unsigned char* s = (const unsigned char*) s_;
+    size_t k = ss->n;
+    size_t i = 0;
+
+    if (n < k) return false;
+
+    /* the last position at which the needle could start */
+    size_t last = n - k;
+
+#if defined(__AVX2__)
+    const __m256i first32 = _mm256_set1_epi8(ss->needle[0]);
+    const __m256i firstf32 = _mm256_set1_epi8(ss->fold[0]);
+    const __m256i last32 = _mm256_set1_epi8(ss->needle[k - 1]);
+    const __m256i lastf32 = _mm256_set1_epi8(ss->fold[k - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i a = _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i*) (s + i)), firstf32);
+        __m256i b = _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i*) (s + i + k - 1)), lastf32);
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, first32),
+                                 _mm256_cmpeq_epi8(b, last32)));
+        if (strsearch_candidates(ss, s, i, mask)) return true;
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i first16 = _mm_set1_epi8(ss->needle[0]);
+    const __m128i firstf16 = _mm_set1_epi8(ss->fold[0]);
+    const __m128i last16 = _mm_set1_epi8(ss->needle[k - 1]);
+    const __m128i lastf16 = _mm_set1_epi8(ss->fold[k - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_or_si128(
+                _mm_loadu_si128((const __m128i*) (s + i)), firstf16);
+        __m128i b = _mm_or_si128(
+                _mm_loadu_si128((const __m128i*) (s + i + k - 1)), lastf16);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first16),
+                              _mm_cmpeq_epi8(b, last16)));
+        if (strsearch_candidates(ss, s, i, mask)) return true;
+    }
+#endif
+
+    for (; i <= last; ++i) {
+        if (strsearch_at(ss, s + i)) return true;
+    }
+
+    return false;
+}
+
@@ -0,0 +1,27 @@
+/*
+ * This file is part of fastq-tools.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * strsearch :
+ * Fast case-insensitive substring search.
+ *
+ */
+
+#ifndef FASTQ_TOOLS_STRSEARCH_H
+#define FASTQ_TOOLS_STRSEARCH_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct strsearch_t_ strsearch_t;
+
+/* Prepare to search for a needle of length n, which must be at least 1. */
+strsearch_t* fastq_alloc_strsearch(const char* needle, size_t n);
+void         fastq_free_strsearch(strsearch_t*);
+
+/* True if the needle, ignoring case, occurs in s. */
+bool fastq_strsearch(const strsearch_t*, const char* s, size_t n);
+
+#endif
+
@@ -8,19 +8,28 @@
  * and O(m) space, implemented according to the original Gotoh paper and
  * Phil Green's implementation in cross_match.
  *
- * There is no fancy bit packing or vectorization, but such features would offer
- * diminishing returns when aligning short sequences such as high throughput
- * sequencing data. For example the Farrar SSE2 algorithm might be a tiny bit
- * faster, but would diminish portability.
+ * When the compiler targets SSE2, alignments are instead computed with Farrar's
+ * striped algorithm (Bioinformatics 23(2), 2007), which is several times faster
+ * for queries of even a few dozen nucleotides. Scores are first computed in 16
+ * unsigned 8-bit lanes, and recomputed in 8 signed 16-bit lanes in the rare
+ * event that they saturate. The scalar implementation is kept as the reference,
+ * and is used whenever the vectorized one can not reproduce it exactly.
  *
  */
 
 
 #include "sw.h"
 #include "common.h"
+#include "nucleotide.h"
+#include <limits.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 static const int sw_default_d[25] =
     /* A   C   G   T   N */
@@ -56,45 +65,280 @@ static inline int imax4(int a, int b, int c, int d)
 }
 
 
+/* True if no alignment can reach min_score, given the best score in the
+ * current row, and the number of rows remaining, since each can add at most the
+ * largest entry of the cost matrix. */
+static inline bool sw_hopeless(const sw_t* sw, int rowmax, int rows_left,
+                               int min_score)
+{
+    return (long) rowmax + (long) rows_left * sw->dmax < min_score;
+}
+
+
 
+/* U aligns as A, though fastq_nt_encode leaves it unknown. */
 void fastq_sw_conv_seq(unsigned char* seq, int n)
 {
-    while (*seq && n) {
-        switch (*seq) {
-            case 'A' :
-            case 'a':
-            case 'U':
-            case 'u':
-                *seq = 0;
-                break;
+    int i;
+    for (i = 0; i < n; ++i) {
+        if ((seq[i] | 0x20) == 'u') seq[i] = 'A';
+    }
+    fastq_nt_encode(seq, (const char*) seq, n);
+}
 
-            case 'C':
-            case 'c':
-                *seq = 1;
-                break;
 
-            case 'G':
-            case 'g':
-                *seq = 2;
-                break;
+#if defined(__SSE2__)
 
-            case 'T':
-            case 't':
-                *seq = 3;
-                break;
+/* The scalar implementation scores column 0 of every row against x[0], and
+ * starts the diagonal into column 1 from zero. As long as no single match
+ * outscores opening a gap, nothing in column 0 can then reach any other
+ * column, so its score is a constant, and the rest is an ordinary local
+ * alignment against subject[1..size-1]. That is what is computed here, with the
+ * constant taken into account in fastq_sw.
+ *
+ * Column j of the subject is held in lane j / seg of segment j % seg. */
+
+static void* sw_aligned_alloc(size_t n)
+{
+    void* p = _mm_malloc(n, 16);
+    if (p == NULL) {
+        fprintf(stderr, "Can not allocate %zu bytes.\n", n);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
+static void sw_striped_init(sw_t* sw)
+{
+    const unsigned char* y = sw->subject + 1;
+    int m = sw->size - 1;
+    int i, j, k, r;
+
+    int dmin = sw->d[0], dmax = sw->dmax;
+    for (i = 1; i < 25; ++i) {
+        if (sw->d[i] < dmin) dmin = sw->d[i];
+    }
+
+    if (m < 1 ||
+        dmax + sw->gap_open > 0 ||
+        sw->gap_open > sw->gap_extend || sw->gap_extend > 0 ||
+        -sw->gap_open > 255 || dmax + imax(0, -dmin) > 255 ||
+        (long) sw->size * dmax >= 0x7fff) {
+        return;
+    }
+
+    sw->bias  = imax(0, -dmin);
+    sw->seg8  = (m + 15) / 16;
+    sw->seg16 = (m + 7) / 8;
+
+    unsigned char* p8 = sw_aligned_alloc(5 * sw->seg8 * 16);
+    for (r = 0; r < 5; ++r) {
+        for (j = 0; j < sw->seg8; ++j) {
+            for (k = 0; k < 16; ++k) {
+                i = k * sw->seg8 + j;
+                p8[(r * sw->seg8 + j) * 16 + k] =
+                    i < m ? sw->d[5 * y[i] + r] + sw->bias : 0;
+            }
+        }
+    }
+
+    short* p16 = sw_aligned_alloc(5 * sw->seg16 * 16);
+    for (r = 0; r < 5; ++r) {
+        for (j = 0; j < sw->seg16; ++j) {
+            for (k = 0; k < 8; ++k) {
+                i = k * sw->seg16 + j;
+                p16[(r * sw->seg16 + j) * 8 + k] =
+                    i < m ? sw->d[5 * y[i] + r] : dmin;
+            }
+        }
+    }
+
+    sw->profile8  = p8;
+    sw->profile16 = p16;
+
+    /* three rows of segments, enough for either lane width */
+    sw->vwork = sw_aligned_alloc(3 * sw->seg16 * sizeof(__m128i));
+}
+
+
+/* Returns -1 if the score does not fit in 8 bits. */
+static int sw_striped8(sw_t* sw, const unsigned char* x, int n, int min_score)
+{
+    const int seg = sw->seg8;
+    const __m128i* profile = sw->profile8;
+    __m128i* hstore = sw->vwork;
+    __m128i* hload  = hstore + seg;
+    __m128i* e      = hload + seg;
+    __m128i* tmp;
+
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i gapo  = _mm_set1_epi8((char) -sw->gap_open);
+    const __m128i gape  = _mm_set1_epi8((char) -sw->gap_extend);
+    const __m128i bias  = _mm_set1_epi8((char) sw->bias);
+    __m128i vmax = zero;
+    __m128i h, f, ve, vrow;
+    const __m128i* p;
+
+    int i, j;
+
+    for (j = 0; j < seg; j++) {
+        hstore[j] = zero;
+        e[j] = zero;
+    }
 
-            case 'N':
-            case 'n':
-            default:
-                *seq = 4;
+    for (i = 0; i < n; i++) {
+        f = zero;
+        h = _mm_slli_si128(hstore[seg - 1], 1);
+        tmp = hload; hload = hstore; hstore = tmp;
+        p = profile + x[i] * seg;
+
+        for (j = 0; j < seg; j++) {
+            h = _mm_subs_epu8(_mm_adds_epu8(h, p[j]), bias);
+            ve = e[j];
+            h = _mm_max_epu8(h, ve);
+            h = _mm_max_epu8(h, f);
+            vmax = _mm_max_epu8(vmax, h);
+            hstore[j] = h;
+
+            h  = _mm_subs_epu8(h, gapo);
+            e[j] = _mm_max_epu8(_mm_subs_epu8(ve, gape), h);
+            f = _mm_max_epu8(_mm_subs_epu8(f, gape), h);
+
+            h = hload[j];
+        }
+
+        /* carry horizontal gaps across segment boundaries, until they can no
+         * longer improve on anything */
+        f = _mm_slli_si128(f, 1);
+        j = 0;
+        while (true) {
+            h = hstore[j];
+            ve = _mm_subs_epu8(f, _mm_subs_epu8(h, gapo));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(ve, zero)) == 0xffff) break;
+
+            h = _mm_max_epu8(h, f);
+            vmax = _mm_max_epu8(vmax, h);
+            hstore[j] = h;
+            e[j] = _mm_max_epu8(e[j], _mm_subs_epu8(h, gapo));
+
+            f = _mm_subs_epu8(f, gape);
+            if (++j >= seg) {
+                j = 0;
+                f = _mm_slli_si128(f, 1);
+            }
         }
 
-        seq++;
-        n--;
+        if ((long) (n - 1 - i) * sw->dmax < min_score) {
+            vrow = hstore[0];
+            for (j = 1; j < seg; j++) vrow = _mm_max_epu8(vrow, hstore[j]);
+            vrow = _mm_max_epu8(vrow, _mm_srli_si128(vrow, 8));
+            vrow = _mm_max_epu8(vrow, _mm_srli_si128(vrow, 4));
+            vrow = _mm_max_epu8(vrow, _mm_srli_si128(vrow, 2));
+            vrow = _mm_max_epu8(vrow, _mm_srli_si128(vrow, 1));
+            if (sw_hopeless(sw, _mm_extract_epi16(vrow, 0) & 0xff,
+                            n - 1 - i, min_score)) break;
+        }
     }
+
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 8));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 2));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 1));
+    int score = _mm_extract_epi16(vmax, 0) & 0xff;
+
+    return score + sw->bias >= 255 ? -1 : score;
 }
 
 
+/* As sw_striped8, with scores clamped to zero from below by hand, since SSE2
+ * lacks unsigned 16-bit maximum. Scores always fit, as checked in
+ * sw_striped_init. */
+static int sw_striped16(sw_t* sw, const unsigned char* x, int n, int min_score)
+{
+    const int seg = sw->seg16;
+    const __m128i* profile = sw->profile16;
+    __m128i* hstore = sw->vwork;
+    __m128i* hload  = hstore + seg;
+    __m128i* e      = hload + seg;
+    __m128i* tmp;
+
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i gapo  = _mm_set1_epi16((short) -sw->gap_open);
+    const __m128i gape  = _mm_set1_epi16((short) -sw->gap_extend);
+    __m128i vmax = zero;
+    __m128i h, f, ve, vrow;
+    const __m128i* p;
+
+    int i, j;
+
+    for (j = 0; j < seg; j++) {
+        hstore[j] = zero;
+        e[j] = zero;
+    }
+
+    for (i = 0; i < n; i++) {
+        f = zero;
+        h = _mm_slli_si128(hstore[seg - 1], 2);
+        tmp = hload; hload = hstore; hstore = tmp;
+        p = profile + x[i] * seg;
+
+        for (j = 0; j < seg; j++) {
+            h = _mm_max_epi16(_mm_adds_epi16(h, p[j]), zero);
+            ve = e[j];
+            h = _mm_max_epi16(h, ve);
+            h = _mm_max_epi16(h, f);
+            vmax = _mm_max_epi16(vmax, h);
+            hstore[j] = h;
+
+            h  = _mm_subs_epu16(h, gapo);
+            e[j] = _mm_max_epi16(_mm_subs_epu16(ve, gape), h);
+            f = _mm_max_epi16(_mm_subs_epu16(f, gape), h);
+
+            h = hload[j];
+        }
+
+        f = _mm_slli_si128(f, 2);
+        j = 0;
+        while (true) {
+            h = hstore[j];
+            if (_mm_movemask_epi8(_mm_cmpgt_epi16(f, _mm_subs_epu16(h, gapo))) == 0) {
+                break;
+            }
+
+            h = _mm_max_epi16(h, f);
+            vmax = _mm_max_epi16(vmax, h);
+            hstore[j] = h;
+            e[j] = _mm_max_epi16(e[j], _mm_subs_epu16(h, gapo));
+
+            f = _mm_subs_epu16(f, gape);
+            if (++j >= seg) {
+                j = 0;
+                f = _mm_slli_si128(f, 2);
+            }
+        }
+
+        if ((long) (n - 1 - i) * sw->dmax < min_score) {
+            vrow = hstore[0];
+            for (j = 1; j < seg; j++) vrow = _mm_max_epi16(vrow, hstore[j]);
+            vrow = _mm_max_epi16(vrow, _mm_srli_si128(vrow, 8));
+            vrow = _mm_max_epi16(vrow, _mm_srli_si128(vrow, 4));
+            vrow = _mm_max_epi16(vrow, _mm_srli_si128(vrow, 2));
+            if (sw_hopeless(sw, (short) _mm_extract_epi16(vrow, 0),
+                            n - 1 - i, min_score)) break;
+        }
+    }
+
+    vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 8));
+    vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 4));
+    vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 2));
+
+    return (short) _mm_extract_epi16(vmax, 0);
+}
+
+#endif
+
+
 sw_t* fastq_alloc_sw(const unsigned char* subject, int size)
 {
     sw_t* sw = malloc_or_die(sizeof(sw_t));
@@ -109,10 +353,28 @@ sw_t* fastq_alloc_sw(const unsigned char* subject, int size)
     sw->gap_open   = -4;
     sw->gap_extend = -3;
 
+    int i;
+    sw->dmax = sw->d[0];
+    for (i = 1; i < 25; ++i) sw->dmax = imax(sw->dmax, sw->d[i]);
+
     sw->work0 = malloc_or_die(size * sizeof(int));
     sw->work1 = malloc_or_die(size * sizeof(int));
     sw->size   = size;
 
+    sw->profile8  = NULL;
+    sw->profile16 = NULL;
+    sw->vwork     = NULL;
+
+    sw->trace = NULL;
+    sw->trace_size = 0;
+    sw->trace_rows = NULL;
+    sw->trace_rows_size = 0;
+    sw->cigar = NULL;
+    sw->cigar_size = 0;
+#if defined(__SSE2__)
+    sw_striped_init(sw);
+#endif
+
     return sw;
 }
 
@@ -122,12 +384,25 @@ void fastq_free_sw(sw_t* sw)
     free(sw->subject);
     free(sw->work0);
     free(sw->work1);
+    free(sw->trace);
+    free(sw->trace_rows);
+    free(sw->cigar);
+#if defined(__SSE2__)
+    if (sw->profile8) {
+        _mm_free(sw->profile8);
+        _mm_free(sw->profile16);
+        _mm_free(sw->vwork);
+    }
+#endif
     free(sw);
 }
 
 
 
-int fastq_sw(sw_t* sw, const unsigned char* x, int n)
+/* If end_i is not NULL, the first cell with the best score is recorded in
+ * (*end_i, *end_j), unless the score is 0. */
+static int sw_scalar(sw_t* sw, const unsigned char* x, int n, int min_score,
+                     int* end_i, int* end_j)
 {
     /* conveniance */
     int*      maxstu = sw->work0;
@@ -151,6 +426,7 @@ int fastq_sw(sw_t* sw, const unsigned char* x, int n)
 
     int u, s;
     int maxstu0;
+    int rowmax;
 
     for (i = 0; i < n; i++) {
 
@@ -159,7 +435,7 @@ int fastq_sw(sw_t* sw, const unsigned char* x, int n)
         u    = gap_op;
         maxstu[0] = imax4(0, d[5 * y[0] + x[0]], t[0], u);
         maxstu0 = 0;
-        score = imax(score, maxstu[0]);
+        rowmax = maxstu[0];
 
 
         for (j = 1; j < m; j++) {
@@ -169,12 +445,318 @@ int fastq_sw(sw_t* sw, const unsigned char* x, int n)
             maxstu0 = maxstu[j];
 
             maxstu[j] = imax4(0, s, t[j], u);
-            score = imax(score, maxstu[j]);
+            rowmax = imax(rowmax, maxstu[j]);
+        }
+
+        if (rowmax > score) {
+            score = rowmax;
+            if (end_i) {
+                *end_i = i;
+                for (j = 0; maxstu[j] != rowmax; j++);
+                *end_j = j;
+            }
         }
+
+        if (sw_hopeless(sw, rowmax, n - 1 - i, min_score)) break;
     }
 
     return score;
 }
 
 
+int fastq_sw_min(sw_t* sw, const unsigned char* x, int n, int min_score)
+{
+#if defined(__SSE2__)
+    if (sw->profile8 && n > 0) {
+        int score = sw_striped8(sw, x, n, min_score);
+        if (score < 0) score = sw_striped16(sw, x, n, min_score);
+        return imax(score, sw->d[5 * sw->subject[0] + x[0]]);
+    }
+#endif
+
+    return sw_scalar(sw, x, n, min_score, NULL, NULL);
+}
+
+
+int fastq_sw(sw_t* sw, const unsigned char* x, int n)
+{
+    return fastq_sw_min(sw, x, n, INT_MIN);
+}
+
+
+
+/* Traceback matrix entries. The low two bits give where a cell's score came
+ * from, and the others whether each kind of gap was extended, rather than
+ * opened, at that cell. */
+enum {
+    SW_TRACE_START = 0,
+    SW_TRACE_DIAG  = 1,
+    SW_TRACE_INS   = 2,
+    SW_TRACE_DEL   = 3,
+    SW_TRACE_INS_EXTEND = 4,
+    SW_TRACE_DEL_EXTEND = 8
+};
+
+
+/* Fill the traceback matrix for rows i0 through ie and columns 1 through je,
+ * returning the score of cell (ie, je). Column 0 is left out, as fastq_sw does
+ * not let alignments pass through it. */
+static int sw_trace_fill(sw_t* sw, const unsigned char* x, int i0, int ie, int je)
+{
+    const int* d = sw->d;
+    const unsigned char* y = sw->subject;
+    int gap_op = sw->gap_open;
+    int gap_ex = sw->gap_extend;
+    size_t rows = ie - i0 + 1;
+    int i, j;
+
+    if (rows * je > sw->trace_size) {
+        sw->trace_size = rows * je;
+        sw->trace = realloc_or_die(sw->trace, sw->trace_size);
+    }
+
+    if ((size_t) 2 * (je + 1) > sw->trace_rows_size) {
+        sw->trace_rows_size = 2 * (je + 1);
+        sw->trace_rows = realloc_or_die(sw->trace_rows,
+                                        sw->trace_rows_size * sizeof(int));
+    }
+
+    /* scores of the previous row, and of insertions ending in it */
+    int* h = sw->trace_rows;
+    int* t = sw->trace_rows + je + 1;
+    for (j = 0; j <= je; j++) {
+        h[j] = 0;
+        t[j] = INT_MIN / 2;
+    }
+
+    unsigned char* tr;
+    int u, s, diag, best;
+
+    for (i = i0; i <= ie; i++) {
+        tr = sw->trace + (size_t) (i - i0) * je;
+        diag = 0;
+        u = INT_MIN / 2;
+
+        for (j = 1; j <= je; j++) {
+            tr[j - 1] = 0;
+
+            if (h[j] + gap_op >= t[j] + gap_ex) t[j] = h[j] + gap_op;
+            else {
+                t[j] = t[j] + gap_ex;
+                tr[j - 1] |= SW_TRACE_INS_EXTEND;
+            }
+
+            if (h[j - 1] + gap_op >= u + gap_ex) u = h[j - 1] + gap_op;
+            else {
+                u = u + gap_ex;
+                tr[j - 1] |= SW_TRACE_DEL_EXTEND;
+            }
+
+            s = diag + d[5 * y[j] + x[i]];
+            diag = h[j];
+
+            best = 0;
+            if (s > best) {
+                best = s;
+                tr[j - 1] |= SW_TRACE_DIAG;
+            }
+            if (t[j] > best) {
+                best = t[j];
+                tr[j - 1] = (tr[j - 1] & ~3) | SW_TRACE_INS;
+            }
+            if (u > best) {
+                best = u;
+                tr[j - 1] = (tr[j - 1] & ~3) | SW_TRACE_DEL;
+            }
+            h[j] = best;
+        }
+    }
+
+    return h[je];
+}
+
+
+static void sw_cigar_push(sw_t* sw, size_t* len, char op)
+{
+    if (*len + 1 >= sw->cigar_size) {
+        sw->cigar_size = sw->cigar_size ? 2 * sw->cigar_size : 256;
+        sw->cigar = realloc_or_die(sw->cigar, sw->cigar_size);
+    }
+    sw->cigar[(*len)++] = op;
+}
+
+
+int fastq_sw_align(sw_t* sw, const unsigned char* x, int n, sw_alignment_t* aln)
+{
+    int ie = 0, je = 0, i0;
+    size_t len = 0;
+
+    aln->score = sw_scalar(sw, x, n, INT_MIN, &ie, &je);
+
+    if (aln->score <= 0) {
+        aln->query_start = aln->query_end = 0;
+        aln->subject_start = aln->subject_end = 0;
+        sw_cigar_push(sw, &len, '\0');
+        aln->cigar = sw->cigar;
+        return aln->score;
+    }
+
+    /* The best score was found in column 0, which always pairs the first
+     * nucleotides of the two sequences. */
+    if (je == 0) {
+        aln->query_start = aln->subject_start = 0;
+        aln->query_end = aln->subject_end = 1;
+        sw_cigar_push(sw, &len, '1');
+        sw_cigar_push(sw, &len, 'M');
+        sw_cigar_push(sw, &len, '\0');
+        aln->cigar = sw->cigar;
+        return aln->score;
+    }
+
+    /* An alignment ending at column je pairs at most je nucleotides, and each
+     * insertion costs at least the gap extension, which bounds how many rows
+     * it can span. */
+    i0 = 0;
+    if (sw->gap_extend < 0) {
+        long ins = ((long) sw->dmax * je - aln->score) / -sw->gap_extend;
+        if (ie - je - ins > 0) i0 = ie - je - (int) ins;
+    }
+
+    if (sw_trace_fill(sw, x, i0, ie, je) != aln->score) {
+        i0 = 0;
+        sw_trace_fill(sw, x, i0, ie, je);
+    }
+
+    /* Trace back from the end, collecting operations in reverse. */
+    int i = ie, j = je;
+    int state = SW_TRACE_DIAG;
+    unsigned char tr;
+
+    while (i >= i0 && j >= 1) {
+        tr = sw->trace[(size_t) (i - i0) * je + j - 1];
+
+        if (state == SW_TRACE_DIAG) {
+            state = tr & 3;
+            if (state == SW_TRACE_START) break;
+            if (state != SW_TRACE_DIAG) continue;
+            sw_cigar_push(sw, &len, 'M');
+            i--;
+            j--;
+        }
+        else if (state == SW_TRACE_INS) {
+            sw_cigar_push(sw, &len, 'I');
+            if (!(tr & SW_TRACE_INS_EXTEND)) state = SW_TRACE_DIAG;
+            i--;
+        }
+        else {
+            sw_cigar_push(sw, &len, 'D');
+            if (!(tr & SW_TRACE_DEL_EXTEND)) state = SW_TRACE_DIAG;
+            j--;
+        }
+    }
+
+    aln->query_start   = i + 1;
+    aln->query_end     = ie + 1;
+    aln->subject_start = j + 1;
+    aln->subject_end   = je + 1;
+
+    /* Run-length encode the operations, which take at most as much space as
+     * they do now, into the end of the buffer, then move them to the front. */
+    size_t ops = len, k, run, pos;
+    char buf[16];
+    int blen;
+
+    while (sw->cigar_size < 3 * ops + 1) {
+        sw->cigar_size *= 2;
+        sw->cigar = realloc_or_die(sw->cigar, sw->cigar_size);
+    }
+
+    pos = ops;
+    k = ops;
+    while (k > 0) {
+        run = 1;
+        while (run < k && sw->cigar[k - 1 - run] == sw->cigar[k - 1]) run++;
+        blen = snprintf(buf, sizeof(buf), "%zu%c", run, sw->cigar[k - 1]);
+        memcpy(sw->cigar + pos, buf, blen);
+        pos += blen;
+        k -= run;
+    }
+
+    memmove(sw->cigar, sw->cigar + ops, pos - ops);
+    sw->cigar[pos - ops] = '\0';
+    aln->cigar = sw->cigar;
+
+    return aln->score;
+}
+
+
+
+edit_t* fastq_alloc_edit(const unsigned char* subject, int size)
+{
+    if (size < 1 || size > FASTQ_EDIT_MAX_SIZE) {
+        fprintf(stderr, "Edit distance queries must have 1 to %d nucleotides.\n",
+                FASTQ_EDIT_MAX_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    edit_t* ed = malloc_or_die(sizeof(edit_t));
+    memset(ed->peq, 0, sizeof(ed->peq));
+    ed->size = size;
+
+    int i;
+    for (i = 0; i < size; i++) {
+        if (subject[i] < 4) ed->peq[subject[i]] |= (uint64_t) 1 << i;
+    }
+
+    return ed;
+}
+
+
+void fastq_free_edit(edit_t* ed)
+{
+    free(ed);
+}
+
+
+/* This follows Hyyrö's formulation of Myers' algorithm, keeping the vertical
+ * differences of one column of the dynamic programming matrix, each in one bit
+ * of Pv (+1) or Mv (-1). The top row is left at zero, so that a match may begin
+ * anywhere in the query, and the score of the last row is tracked through its
+ * horizontal differences. */
+int fastq_edit(const edit_t* ed, const unsigned char* x, int n, int* end)
+{
+    const uint64_t high = (uint64_t) 1 << (ed->size - 1);
+    uint64_t pv = ~(uint64_t) 0, mv = 0;
+    uint64_t eq, xv, xh, ph, mh;
+    int score = ed->size;
+    int best = score;
+    int i;
+
+    *end = 0;
+
+    for (i = 0; i < n; i++) {
+        eq = ed->peq[x[i] < 4 ? x[i] : 4];
+        xv = eq | mv;
+        xh = (((eq & pv) + pv) ^ pv) | eq;
+        ph = mv | ~(xh | pv);
+        mh = pv & xh;
+
+        if (ph & high)      score++;
+        else if (mh & high) score--;
+
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (score < best) {
+            best = score;
+            *end = i + 1;
+            if (best == 0) break;
+        }
+    }
+
+    return best;
+}
+
 
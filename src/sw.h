@@ -11,6 +11,9 @@
 #ifndef FASTQ_TOOLS_SW_H
 #define FASTQ_TOOLS_SW_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 
 typedef struct
 {
@@ -25,15 +28,83 @@ typedef struct
     int* work0;
     int* work1;
 
+    /* striped query profiles and rows for the vectorized kernel, used
+     * internally, or NULL if it can not be used */
+    void* profile8;
+    void* profile16;
+    void* vwork;
+    int seg8;
+    int seg16;
+    int bias;
+
+    /* largest entry of the cost matrix */
+    int dmax;
+
+    /* traceback matrix, rows, and CIGAR string, used internally */
+    unsigned char* trace;
+    size_t trace_size;
+    int* trace_rows;
+    size_t trace_rows_size;
+    char* cigar;
+    size_t cigar_size;
+
 } sw_t;
 
-/* convert a n ASCII nucleotide sequence to one suitable for fastq_sw */
+
+/* A local alignment, where query is the sequence passed to fastq_sw_align, and
+ * subject the one the sw_t was allocated with. Offsets are 0-based, with ends
+ * just past the last aligned position. */
+typedef struct
+{
+    int score;
+    int query_start, query_end;
+    int subject_start, subject_end;
+
+    /* M for aligned pairs, I for query nucleotides missing from the subject,
+     * and D for subject nucleotides missing from the query. Valid until the
+     * sw_t is next used for an alignment. */
+    const char* cigar;
+} sw_alignment_t;
+
+/* convert a n ASCII nucleotide sequence to one suitable for fastq_sw, in
+ * place, as by fastq_nt_encode, but with U as A */
 void fastq_sw_conv_seq(unsigned char*, int n);
 
+/* The cost matrix and gap costs are fixed when the sw_t is allocated. */
 sw_t* fastq_alloc_sw(const unsigned char *subject, int size);
 void  fastq_free_sw(sw_t*);
 
 int fastq_sw(sw_t*, const unsigned char* query, int size);
 
+/* As fastq_sw, but giving up as soon as the score can no longer reach
+ * min_score, in which case some smaller score is returned. */
+int fastq_sw_min(sw_t*, const unsigned char* query, int size, int min_score);
+
+/* As fastq_sw, but also finding the alignment that achieves the score. This is
+ * several times slower, so is best used only on sequences that are known to
+ * score well. */
+int fastq_sw_align(sw_t*, const unsigned char* query, int size,
+                   sw_alignment_t* aln);
+
+
+/* Approximate matching of a subject of at most 64 nucleotides by edit
+ * distance, using Myers' bit-parallel algorithm. */
+#define FASTQ_EDIT_MAX_SIZE 64
+
+typedef struct
+{
+    /* bit i is set in peq[c] if the subject has nucleotide c at position i */
+    uint64_t peq[5];
+    int size;
+} edit_t;
+
+/* subject is converted as for fastq_sw, and N matches nothing */
+edit_t* fastq_alloc_edit(const unsigned char* subject, int size);
+void    fastq_free_edit(edit_t*);
+
+/* The fewest edits needed to match the subject somewhere in the query, with
+ * *end set to the offset just past the first place such a match ends. */
+int fastq_edit(const edit_t*, const unsigned char* query, int size, int* end);
+
 #endif
 